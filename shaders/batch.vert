@@ -0,0 +1,33 @@
+#version 450 core
+
+// Vertex shader of MeshBatch. Every draw of the multi draw reads its
+// offset by draw index, with BATCH_DRAW_ID from gl_DrawIDARB and else
+// from u_draw, which the batch sets before every draw
+#ifdef BATCH_DRAW_ID
+#extension GL_ARB_shader_draw_parameters : require
+#endif
+
+layout (location = 0) in vec3 a_pos;
+layout (location = 1) in vec2 a_uv;
+
+layout (std430, binding = 17) readonly buffer BatchDrawBuf {
+    vec4 offsets[];
+};
+
+uniform mat4 u_view_proj;
+
+#ifndef BATCH_DRAW_ID
+uniform uint u_draw;
+#endif
+
+out vec2 uv;
+
+void main() {
+#ifdef BATCH_DRAW_ID
+    const uint draw = gl_DrawIDARB;
+#else
+    const uint draw = u_draw;
+#endif
+    gl_Position = u_view_proj * vec4(a_pos + offsets[draw].xyz, 1);
+    uv = a_uv;
+}
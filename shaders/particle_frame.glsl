@@ -0,0 +1,40 @@
+// Per frame parameters, written by the CPU into a persistently mapped ring
+// buffer once per frame and bound as a range for every particle pass
+
+// Most frames a particle of the temporal LOD goes without a force update
+#define LOD_WAIT_FRAMES 16
+
+struct Spawner {
+    vec3  pos;
+    float mass;
+    // Inclusive prefix sum of the spawns of every spawner this frame
+    uint  spawn_end;
+};
+
+layout (std430, binding = 8) readonly buffer FrameBuf {
+    mat4  u_transform;
+    mat4  u_proj;
+    // u_proj * u_transform
+    mat4  u_view_proj;
+    float dt;
+    float particle_life;
+    uint  max_particles;
+    uint  spawn_count;
+    uint  spawner_num;
+    // Updates of the pool so far, staggers the temporal LOD
+    uint  frame;
+    // Camera distance from which particles sum the spawner forces less
+    // often, 0 sums them every frame
+    float lod_near;
+    // Non zero when the simulation reduces the bounds of every cloud
+    uint  bounds_enabled;
+    // Non zero when the draw reads the snapshot, else the visible slots
+    uint  snapshot;
+    // View space frustum planes facing inwards with unit normals. All of
+    // them are (0, 0, 0, 1) when culling is off
+    vec4  frustum[6];
+    // Seconds of the last i + 1 frames up to this one, the temporal LOD
+    // integrates the forces of a particle over the frames it waited
+    float lod_elapsed[LOD_WAIT_FRAMES];
+    Spawner spawners[];
+};
@@ -0,0 +1,139 @@
+// Particle storage shared by the particle shaders. AoS by default, with
+// PARTICLE_SOA the record is split into streams so a pass only fetches the
+// fields it uses. PARTICLE_COMPACT quantizes the record down to 28 bytes
+
+// Frames since the last force update of the temporal LOD. The AoS record
+// keeps them in its padding, the other layouts in the top bits of the
+// spawner word
+#define LOD_WAIT_SHIFT 28
+#define SPAWNER_MASK 0x0fffffffu
+
+struct Particle {
+    vec3  pos;
+    vec3  vel;
+    float mass;
+    float life;
+    float scale;
+    uint  spawner;
+    uint  lod_wait;
+};
+
+#if defined(PARTICLE_SOA)
+layout (std430, binding = 0) buffer ParticlePosLifeBuf {
+    vec4 particle_pos_life[];
+};
+
+layout (std430, binding = 5) buffer ParticleVelMassBuf {
+    vec4 particle_vel_mass[];
+};
+
+layout (std430, binding = 6) buffer ParticleScaleBuf {
+    float particle_scale[];
+};
+
+layout (std430, binding = 7) buffer ParticleSpawnerBuf {
+    uint particle_spawner[];
+};
+
+Particle load_particle(const uint id) {
+    const vec4 pos_life = particle_pos_life[id];
+    const vec4 vel_mass = particle_vel_mass[id];
+    const uint spawner = particle_spawner[id];
+    return Particle(pos_life.xyz, vel_mass.xyz, vel_mass.w, pos_life.w,
+                    particle_scale[id], spawner & SPAWNER_MASK,
+                    spawner >> LOD_WAIT_SHIFT);
+}
+
+// Writes back what the simulation changes (pos, vel & life)
+void store_particle_motion(const uint id, const Particle p) {
+    particle_pos_life[id] = vec4(p.pos, p.life);
+    particle_vel_mass[id] = vec4(p.vel, p.mass);
+}
+
+// Writes back the frames since the last force update
+void store_particle_lod(const uint id, const Particle p) {
+    particle_spawner[id] = p.spawner | p.lod_wait << LOD_WAIT_SHIFT;
+}
+
+void store_particle(const uint id, const Particle p) {
+    store_particle_motion(id, p);
+    store_particle_lod(id, p);
+    particle_scale[id] = p.scale;
+}
+#elif defined(PARTICLE_COMPACT)
+#define PACKED_SCALE_MAX 2.0
+#define PACKED_LIFE_MAX 16.0
+
+// Full precision position, half float velocity & mass, scale and life as
+// 16 bit fixed point over [0, PACKED_*_MAX]
+struct PackedParticle {
+    float pos_x;
+    float pos_y;
+    float pos_z;
+    uint  vel_xy;
+    uint  vel_z_mass;
+    uint  scale_life;
+    uint  spawner;
+};
+
+layout (std430, binding = 0) buffer PackedParticlesBuf {
+    PackedParticle packed_particles[];
+};
+
+Particle load_particle(const uint id) {
+    const PackedParticle pp = packed_particles[id];
+    const vec2 vel_z_mass = unpackHalf2x16(pp.vel_z_mass);
+    const vec2 scale_life = unpackUnorm2x16(pp.scale_life) *
+        vec2(PACKED_SCALE_MAX, PACKED_LIFE_MAX);
+    return Particle(vec3(pp.pos_x, pp.pos_y, pp.pos_z),
+                    vec3(unpackHalf2x16(pp.vel_xy), vel_z_mass.x),
+                    vel_z_mass.y, scale_life.y, scale_life.x,
+                    pp.spawner & SPAWNER_MASK, pp.spawner >> LOD_WAIT_SHIFT);
+}
+
+// Every field shares a word with another one, so the record is rewritten
+void store_particle_motion(const uint id, const Particle p) {
+    PackedParticle pp;
+    pp.pos_x = p.pos.x;
+    pp.pos_y = p.pos.y;
+    pp.pos_z = p.pos.z;
+    pp.vel_xy = packHalf2x16(p.vel.xy);
+    pp.vel_z_mass = packHalf2x16(vec2(p.vel.z, p.mass));
+    pp.scale_life = packUnorm2x16(vec2(p.scale, p.life) /
+                                  vec2(PACKED_SCALE_MAX, PACKED_LIFE_MAX));
+    pp.spawner = p.spawner | p.lod_wait << LOD_WAIT_SHIFT;
+    packed_particles[id] = pp;
+}
+
+// Already written with the motion
+void store_particle_lod(const uint id, const Particle p) {
+}
+
+void store_particle(const uint id, const Particle p) {
+    store_particle_motion(id, p);
+}
+#else
+layout (std430, binding = 0) buffer ParticlesBuf {
+    Particle particles[];
+};
+
+Particle load_particle(const uint id) {
+    return particles[id];
+}
+
+// Writes back what the simulation changes (pos, vel & life)
+void store_particle_motion(const uint id, const Particle p) {
+    particles[id].pos = p.pos;
+    particles[id].vel = p.vel;
+    particles[id].life = p.life;
+}
+
+// Writes back the frames since the last force update
+void store_particle_lod(const uint id, const Particle p) {
+    particles[id].lod_wait = p.lod_wait;
+}
+
+void store_particle(const uint id, const Particle p) {
+    particles[id] = p;
+}
+#endif
@@ -1,14 +1,16 @@
 #version 450 core
 
-flat in uint should_discard;
 in vec2 uv;
 layout(binding = 0) uniform sampler2D tex;
 
 out vec4 o_col;
 
 void main() {
-    if (should_discard != 0)
+#ifdef PARTICLE_PULL_TRIANGLE
+    // Outside the quad the triangle is drawn around
+    if (any(greaterThan(uv, vec2(1))))
         discard;
+#endif
     o_col = texture(tex, uv);
     if (o_col.a < 1)
         discard;
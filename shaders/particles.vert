@@ -1,33 +1,71 @@
 #version 450 core
 
-struct Particle {
-    vec3  pos;
-    vec3  vel;
-    float mass;
-    float life;
-    float scale;
+#include "particle_frame.glsl"
+
+#ifdef PARTICLE_FROM_POOL
+#include "particle_storage.glsl"
+
+// Slots of the visible particles, written by the simulation of this frame
+layout (std430, binding = 18) readonly buffer VisibleBuf {
+    uint visible_ids[];
 };
 
-layout (std430, binding = 0) buffer ParticlesBuf {
-    Particle particles[];
+// Position and scale of the instance, decoded from the pool
+vec4 instance() {
+    const Particle p = load_particle(visible_ids[gl_InstanceID]);
+    return vec4(p.pos, p.scale);
+}
+#else
+// Position and scale of the visible particles, written by the simulation
+// of this frame into its own half of the double buffered snapshot
+layout (std430, binding = 10) readonly buffer InstanceBuf {
+    vec4 instances[];
 };
 
-layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec2 aUV;
-uniform mat4 u_transform;
-uniform mat4 u_proj;
+vec4 instance() {
+    return instances[gl_InstanceID];
+}
+#endif
 
-flat out uint should_discard;
 out vec2 uv;
 
+// PARTICLE_PULL makes the corners from gl_VertexID instead of a mesh, as a
+// quad of 6 vertices or with PARTICLE_PULL_TRIANGLE a single triangle
+// around it
+#ifdef PARTICLE_PULL
+// Half the side of a billboard at scale 1, like the quad of objects.cpp
+#define BILLBOARD_HALF 0.1
+
+#ifdef PARTICLE_PULL_TRIANGLE
+// Its uvs reach 2, particles.frag discards past 1
+const vec2 corners[3] = vec2[](
+    vec2(-1, -1), vec2(3, -1), vec2(-1, 3)
+);
+#else
+const vec2 corners[6] = vec2[](
+    vec2(-1, -1), vec2(1, -1), vec2(1, 1),
+    vec2(1, 1), vec2(-1, 1), vec2(-1, -1)
+);
+#endif
+
+void main() {
+    const vec4 inst = instance();
+    const vec2 corner = corners[gl_VertexID];
+    // The billboard is offset in view space, which the projection maps
+    // through its first two columns alone
+    const vec2 offset = corner * BILLBOARD_HALF * inst.w;
+    gl_Position = u_view_proj * vec4(inst.xyz, 1) +
+        offset.x * u_proj[0] + offset.y * u_proj[1];
+    uv = corner * 0.5 + 0.5;
+}
+#else
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aUV;
+
 void main() {
-    Particle p = particles[gl_InstanceID];
-    if (p.life <= 0) {
-        should_discard = 1;
-        return;
-    }
-    should_discard = 0;
-    gl_Position = u_proj * ((u_transform * vec4(p.pos, 1)) +
-        vec4(aPos*p.scale, 0));
+    const vec4 inst = instance();
+    gl_Position = u_proj * ((u_transform * vec4(inst.xyz, 1)) +
+        vec4(aPos*inst.w, 0));
     uv = aUV;
 }
+#endif
@@ -0,0 +1,13 @@
+// Spawner state resident on the GPU, stepped by spawner.comp and read by
+// the particle passes in place of the positions uploaded every frame
+
+struct SpawnerState {
+    vec3  pos;
+    float mass;
+    vec3  vel;
+    float _p;
+};
+
+layout (std430, binding = 9) buffer SpawnerStateBuf {
+    SpawnerState spawner_state[];
+};
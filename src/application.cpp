@@ -10,12 +10,16 @@
 #include "application.hpp"
 #include "glm/ext/vector_float2.hpp"
 #include "logger.hpp"
+#include "profiler.hpp"
 #include <GLFW/glfw3.h>
+#include <cstdlib>
 #include <glm/glm.hpp>
 
 #define TITLE "Flowers"
 #define BG_COLOR 3/255.0, 182/255.0, 252/255.0, 1
 #define FOV 45.0f
+#define HEADLESS_WIDTH 1280
+#define HEADLESS_HEIGHT 720
 
 using namespace std;
 using namespace glm;
@@ -29,6 +33,7 @@ static bool is_mouse_locked = false;
 
 static float last_time = 0;
 static bool is_cursor_locked = false;
+static bool is_headless = false;
 
 /**
  * \brief GLFW callback when window resizes
@@ -84,20 +89,50 @@ void APIENTRY gl_error_callback(GLuint source, GLuint type, GLuint id,
         exit(type);
 }
 
+/**
+ * \brief Creates an invisible window for offscreen rendering. Without a
+ * display server GLFW's null platform is used with a surfaceless EGL context,
+ * falling back to OSMesa (both work with Mesa llvmpipe)
+ * \return the created window or nullptr
+ */
+static GLFWwindow *create_headless_window() {
+    wind_size.x = HEADLESS_WIDTH, wind_size.y = HEADLESS_HEIGHT;
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    GLFWwindow *wind = glfwCreateWindow(wind_size.x, wind_size.y,
+                                        TITLE, 0, 0);
+    if (wind || (getenv("DISPLAY") || getenv("WAYLAND_DISPLAY")))
+        return wind;
+
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    return glfwCreateWindow(wind_size.x, wind_size.y, TITLE, 0, 0);
+}
+
 /**
  * \brief Initializes GLFW & OpenGL. Then creates a window with valid context
+ * \param headless creates a hidden offscreen window instead of fullscreen
  * \return zero if no error occured
  */
-int CreateWindow() {
+int CreateWindow(const bool headless) {
+    is_headless = headless;
+    if (headless && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY")) {
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+    }
     if (!glfwInit())
         THROW(1, "Cannot initialize GLFW");
-    const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
-    wind_size.x = mode->width, wind_size.y = mode->height;
-    
+
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfw_wind = glfwCreateWindow(wind_size.x, wind_size.y, TITLE, 0, 0);
+    if (headless) {
+        glfw_wind = create_headless_window();
+    }
+    else {
+        const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+        wind_size.x = mode->width, wind_size.y = mode->height;
+        glfw_wind = glfwCreateWindow(wind_size.x, wind_size.y, TITLE, 0, 0);
+    }
 
     if (!glfw_wind)
         THROW(1, "Cannot create GLFW window");
@@ -125,11 +160,15 @@ int CreateWindow() {
     glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
 #endif
 
-    ToggleCursor();
-
     cam.proj = mat4(1);
     cam.rot = vec3(0);
     cam.pos = vec3(0);
+
+    // Hidden windows never receive a resize, so set the viewport here
+    if (headless)
+        on_resize(glfw_wind, wind_size.x, wind_size.y);
+    else
+        ToggleCursor();
     return 0;
 }
 
@@ -144,6 +183,7 @@ void CloseWindow() {
  * \brief Renders all drawn meshes
  */
 void Render() {
+    PROFILE_CPU("Render");
     glfwSwapBuffers(glfw_wind);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glClearColor(BG_COLOR);
@@ -174,6 +214,8 @@ float GetDT() {
  * \return true if the key is pressed
  */
 bool IsKeyDown(int key) {
+    if (is_headless)
+        return false;
     return glfwGetKey(glfw_wind, key) == GLFW_PRESS;
 }
 
@@ -190,6 +232,8 @@ void ToggleCursor() {
  * \return relative position of cursor (-1,-1 to 1,1)
  */
 vec2 GetCursorPos() {
+    if (is_headless)
+        return vec2(0);
     double xpos, ypos;
     glfwGetCursorPos(glfw_wind, &xpos, &ypos);
     return vec2(xpos/wind_size.x, ypos/wind_size.y)*2.0f;
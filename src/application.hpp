@@ -12,7 +12,7 @@ public:
 };
 extern Camera cam;
 
-int CreateWindow();
+int CreateWindow(const bool = false);
 void CloseWindow();
 int UpdateWindow();
 void Render();
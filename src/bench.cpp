@@ -0,0 +1,525 @@
+#include "bench.hpp"
+#include "application.hpp"
+#include "gl_func.hpp"
+#include "logger.hpp"
+#include "particle_cpu.hpp"
+#include "profiler.hpp"
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <print>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+static const char *const pass_names[BENCH_PASS_NUM] = {
+    "sim",
+    "scene",
+    "particles",
+    "reorder",
+};
+
+static const char *const layout_names[PARTICLE_LAYOUT_NUM] = {
+    "aos",
+    "soa",
+    "compact",
+};
+
+// Largest error against the CPU reference that still passes --validate,
+// the GPU may fuse and reorder float math
+static const float validate_tolerance[4] = {
+    1e-2f,
+    1e-2f,
+    1e-4f,
+    1e-4f,
+};
+
+static const char *const backend_names[PARTICLE_BACKEND_NUM] = {
+    "gpu",
+    "cpu",
+};
+
+static const char *const atomics_names[PARTICLE_ATOMICS_NUM] = {
+    "auto",
+    "global",
+    "workgroup",
+    "subgroup",
+};
+
+static const char *const draw_names[PARTICLE_DRAW_NUM] = {
+    "mesh",
+    "quad",
+    "triangle",
+};
+
+static const char *const error_names[4] = {
+    "pos",
+    "vel",
+    "life",
+    "scale",
+};
+
+// Bytes of one particle record of every layout, summed over the SoA
+// streams
+static const GLuint layout_record[PARTICLE_LAYOUT_NUM] = {48, 40, 28};
+
+// Estimated bytes moved per live particle by the simulation (read + write
+// of the touched records, alive indices and what it writes for the draw)
+// and the draw of every layout. AoS fetches whole 48 byte records, SoA only
+// the streams a pass uses: it reads pos/life, vel/mass, scale and the
+// spawner id and writes pos/life and vel/mass. The pipelined draw reads the
+// 16 byte snapshot, otherwise a 4 byte slot and the pos/life and scale of
+// the record, all 28 bytes of a compact one
+static const GLuint layout_traffic[PARTICLE_LAYOUT_NUM][2] = {
+    {48 + 48 + 8, 48},
+    {40 + 32 + 8, 20},
+    {28 + 28 + 8, 28},
+};
+
+SpawnerConfig BenchConfig::GetSpawnerConfig() const {
+    SpawnerConfig spawner_cfg;
+    spawner_cfg.layout = layout;
+    spawner_cfg.backend = backend;
+    spawner_cfg.atomics = atomics;
+    spawner_cfg.draw = draw;
+    spawner_cfg.threads = threads;
+    spawner_cfg.gpu_spawners = gpu_spawners;
+    spawner_cfg.initial_particles = initial_particles;
+    spawner_cfg.budget = budget;
+    spawner_cfg.priorities = priorities;
+    spawner_cfg.rates = rates;
+    spawner_cfg.reorder = reorder;
+    spawner_cfg.pipeline = pipeline;
+    spawner_cfg.lod_near = lod_near;
+    spawner_cfg.culling = culling;
+    spawner_cfg.cloud_bounds = cloud_bounds;
+    spawner_cfg.shadow_float = layout_error;
+    spawner_cfg.reference = validate;
+    if (spawners)
+        spawner_cfg.spawners = spawners;
+    if (particles) {
+        spawner_cfg.particles = particles;
+        spawner_cfg.saturate = true;
+    }
+    return spawner_cfg;
+}
+
+Bench::Bench(const BenchConfig &_cfg) : cfg(_cfg) {
+    if (!cfg.enabled)
+        return;
+    cpu_ms.reserve(cfg.frames);
+    cpu_sim_ms.reserve(cfg.frames);
+    reference_ms.reserve(cfg.frames);
+    for (GLuint i = 0; i < BENCH_PASS_NUM; ++i)
+        gpu_ms[i].reserve(cfg.frames);
+    ProfilerSetSink([this](const ProfileEvent &e) { CollectZone(e); });
+}
+
+Bench::~Bench() {
+    if (cfg.enabled)
+        ProfilerSetSink(nullptr);
+}
+
+/**
+ * \brief Parses a comma separated list of non negative numbers, one value
+ * per spawner from the first
+ * \return zero if the whole list parsed
+ */
+template<typename T>
+static int parse_list(const char *const list, vector<T> *out) {
+    const char *it = list;
+    while (*it) {
+        // strtoul would wrap a negative count around, and skip blanks and
+        // signs before it. No entry may be negative
+        if (!isdigit((unsigned char)*it) && *it != '.')
+            THROW(1, "Bad list '{}', entries are unsigned numbers", list);
+        char *end;
+        if constexpr (is_integral_v<T>) {
+            const unsigned long val = strtoul(it, &end, 10);
+            if (val > numeric_limits<T>::max())
+                THROW(1, "Entry out of range in list '{}'", list);
+            out->push_back(val);
+        } else
+            out->push_back(strtod(it, &end));
+        if (end == it)
+            THROW(1, "Bad list '{}'", list);
+        it = end;
+        if (*it == ',')
+            ++it;
+        else if (*it)
+            THROW(1, "Bad list '{}'", list);
+    }
+    return 0;
+}
+
+int Bench::ParseArgs(const int argc, const char *const *argv,
+                     BenchConfig *cfg) {
+    for (int i = 1; i < argc; ++i) {
+        const char *const arg = argv[i];
+        const bool has_val = i + 1 < argc;
+        if (!strcmp(arg, "--bench"))
+            cfg->enabled = true;
+        else if (!strcmp(arg, "--frames") && has_val)
+            cfg->frames = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--warmup") && has_val)
+            cfg->warmup = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--dt") && has_val)
+            cfg->dt = strtof(argv[++i], nullptr);
+        else if (!strcmp(arg, "--out") && has_val)
+            cfg->out = argv[++i];
+        else if (!strcmp(arg, "--particles") && has_val)
+            cfg->particles = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--initial-particles") && has_val)
+            cfg->initial_particles = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--budget") && has_val)
+            cfg->budget = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--priorities") && has_val) {
+            if (parse_list(argv[++i], &cfg->priorities))
+                return 1;
+        }
+        else if (!strcmp(arg, "--rates") && has_val) {
+            if (parse_list(argv[++i], &cfg->rates))
+                return 1;
+        }
+        else if (!strcmp(arg, "--reorder") && has_val)
+            cfg->reorder = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--pipeline"))
+            cfg->pipeline = true;
+        else if (!strcmp(arg, "--lod-near") && has_val)
+            cfg->lod_near = strtof(argv[++i], nullptr);
+        else if (!strcmp(arg, "--no-cull"))
+            cfg->culling = false;
+        else if (!strcmp(arg, "--no-bounds"))
+            cfg->cloud_bounds = false;
+        else if (!strcmp(arg, "--spawners") && has_val)
+            cfg->spawners = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--layout") && has_val) {
+            const char *const name = argv[++i];
+            GLuint l = 0;
+            while (l < PARTICLE_LAYOUT_NUM && strcmp(name, layout_names[l]))
+                ++l;
+            if (l == PARTICLE_LAYOUT_NUM)
+                THROW(1, "Unknown particle layout '{}'", name);
+            cfg->layout = (ParticleLayout)l;
+        }
+        else if (!strcmp(arg, "--backend") && has_val) {
+            const char *const name = argv[++i];
+            GLuint b = 0;
+            while (b < PARTICLE_BACKEND_NUM && strcmp(name, backend_names[b]))
+                ++b;
+            if (b == PARTICLE_BACKEND_NUM)
+                THROW(1, "Unknown particle backend '{}'", name);
+            cfg->backend = (ParticleBackend)b;
+        }
+        else if (!strcmp(arg, "--atomics") && has_val) {
+            const char *const name = argv[++i];
+            GLuint a = 0;
+            while (a < PARTICLE_ATOMICS_NUM && strcmp(name, atomics_names[a]))
+                ++a;
+            if (a == PARTICLE_ATOMICS_NUM)
+                THROW(1, "Unknown atomics mode '{}'", name);
+            cfg->atomics = (ParticleAtomics)a;
+        }
+        else if (!strcmp(arg, "--draw") && has_val) {
+            const char *const name = argv[++i];
+            GLuint d = 0;
+            while (d < PARTICLE_DRAW_NUM && strcmp(name, draw_names[d]))
+                ++d;
+            if (d == PARTICLE_DRAW_NUM)
+                THROW(1, "Unknown particle draw mode '{}'", name);
+            cfg->draw = (ParticleDraw)d;
+        }
+        else if (!strcmp(arg, "--threads") && has_val)
+            cfg->threads = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(arg, "--gpu-spawners"))
+            cfg->gpu_spawners = true;
+        else if (!strcmp(arg, "--layout-error"))
+            cfg->layout_error = true;
+        else if (!strcmp(arg, "--validate"))
+            cfg->validate = true;
+        else if (!strcmp(arg, "--trace") && has_val)
+            cfg->trace = argv[++i];
+        else
+            THROW(1, "Unknown argument '{}'\n"
+                  "usage: {} [--bench [--frames N] [--warmup N] "
+                  "[--dt SECONDS] [--out FILE] [--layout-error] "
+                  "[--validate]] "
+                  "[--particles N] [--initial-particles N] "
+                  "[--budget N [--priorities P,P,...]] [--rates R,R,...] "
+                  "[--spawners N] [--gpu-spawners] [--reorder FRAMES] "
+                  "[--pipeline] "
+                  "[--lod-near DISTANCE] [--no-cull] "
+                  "[--no-bounds] "
+                  "[--layout aos|soa|compact] "
+                  "[--backend gpu|cpu] [--threads N] "
+                  "[--atomics auto|global|workgroup|subgroup] "
+                  "[--draw mesh|quad|triangle] "
+                  "[--trace FILE]",
+                  arg, argv[0]);
+    }
+
+    if (cfg->enabled && (cfg->frames == 0 || cfg->dt <= 0))
+        THROW(1, "Benchmark needs frames > 0 and dt > 0");
+    return 0;
+}
+
+bool Bench::IsEnabled() const {
+    return cfg.enabled;
+}
+
+bool Bench::IsDone() const {
+    return cfg.enabled && frame >= cfg.warmup + cfg.frames;
+}
+
+float Bench::GetDT() const {
+    return cfg.enabled ? cfg.dt : ::GetDT();
+}
+
+void Bench::BeginFrame() {
+    if (!cfg.enabled)
+        return;
+    if (frame == cfg.warmup)
+        measure_from = ProfilerGetFrame();
+    frame_start = chrono::steady_clock::now();
+}
+
+void Bench::EndFrame() {
+    if (!cfg.enabled)
+        return;
+    const chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - frame_start;
+    if (frame >= cfg.warmup)
+        cpu_ms.push_back(elapsed.count());
+    ++frame;
+}
+
+/**
+ * \brief Keeps the GPU zones of the passes and the CPU reference's zone
+ * measured after the warmup
+ */
+void Bench::CollectZone(const ProfileEvent &e) {
+    if (frame < cfg.warmup || e.frame < measure_from)
+        return;
+    if (!e.gpu) {
+        if (!strcmp(e.name, "reference"))
+            reference_ms.push_back(e.dur_ns / 1e6);
+        else if (!strcmp(e.name, "cpu_sim"))
+            cpu_sim_ms.push_back(e.dur_ns / 1e6);
+        return;
+    }
+    for (GLuint i = 0; i < BENCH_PASS_NUM; ++i)
+        if (!strcmp(e.name, pass_names[i]))
+            gpu_ms[i].push_back(e.dur_ns / 1e6);
+}
+
+/**
+ * \brief Prints mean, min, max and percentiles of samples as a JSON object
+ */
+static void print_stats(FILE *f, const char *name, vector<double> samples,
+                        const bool last) {
+    if (samples.empty()) {
+        println(f, "    \"{}\": null{}", name, last ? "" : ",");
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    auto pct = [&](const double p) {
+        return samples[(size_t)(p * (samples.size() - 1) + 0.5)];
+    };
+    const double mean = accumulate(samples.begin(), samples.end(), 0.0) /
+        samples.size();
+    println(f, "    \"{}\": {{\"mean\": {:.4f}, \"min\": {:.4f}, "
+            "\"p50\": {:.4f}, \"p90\": {:.4f}, \"p99\": {:.4f}, "
+            "\"max\": {:.4f}}}{}",
+            name, mean, samples.front(), pct(.5), pct(.9), pct(.99),
+            samples.back(), last ? "" : ",");
+}
+
+/**
+ * \brief Prints an error measurement as a JSON object
+ */
+static void print_error(FILE *f, const char *name, const ParticleError &err) {
+    if (!err.valid)
+        ERR("Particles died during the run, slots no longer match up. "
+            "Keep frames * dt below the particle lifetime");
+    println(f, ",");
+    println(f, "  \"{}\": {{", name);
+    println(f, "    \"valid\": {},", err.valid);
+    println(f, "    \"particles\": {},", err.particles);
+    println(f, "    \"lod_near\": {},", err.lod_near);
+    for (GLuint i = 0; i < 4; ++i)
+        println(f, "    \"{}\": {{\"max\": {:.6g}, \"mean\": {:.6g}}}{}",
+                error_names[i], err.max[i], err.mean[i], i < 3 ? "," : "");
+    print(f, "  }}");
+}
+
+/**
+ * \brief Prints the pool's error against the CPU reference
+ * \return true if every error is within validate_tolerance
+ */
+bool Bench::PrintValidation(FILE *f) const {
+    const ParticleError err = MeasureReferenceError();
+    print_error(f, "validation_vs_reference", err);
+    bool passed = err.valid;
+    for (GLuint i = 0; i < 4; ++i) {
+        if (err.max[i] > validate_tolerance[i]) {
+            ERR("Validation failed, max {} error {} exceeds {}",
+                error_names[i], err.max[i], validate_tolerance[i]);
+            passed = false;
+        }
+    }
+    print(f, ",\n  \"validation_passed\": {}", passed);
+    return passed;
+}
+
+/**
+ * \brief Prints the bounds of every spawner's particles the GPU reduced
+ */
+static void print_bounds(FILE *f, const vector<CloudBounds> &bounds) {
+    print(f, "  \"cloud_bounds\": [");
+    for (GLuint i = 0; i < bounds.size(); ++i) {
+        const CloudBounds &b = bounds[i];
+        print(f, "{}\n    {{\"count\": {}, \"min\": [{}, {}, {}], "
+              "\"max\": [{}, {}, {}], \"centroid\": [{}, {}, {}]}}",
+              i ? "," : "", b.count, b.min.x, b.min.y, b.min.z,
+              b.max.x, b.max.y, b.max.z,
+              b.centroid.x, b.centroid.y, b.centroid.z);
+    }
+    println(f, "\n  ],");
+}
+
+/**
+ * \brief Prints the quota and usage of every spawner under the budget
+ */
+static void print_budget(FILE *f, const ParticleBudget &budget) {
+    uint64_t dropped = 0;
+    for (GLuint i = 0; i < budget.CountEmitters(); ++i)
+        dropped += budget.GetUsage(i).dropped;
+    println(f, "  \"budget\": {{");
+    println(f, "    \"cap\": {},", budget.GetCap());
+    println(f, "    \"dropped_spawns\": {},", dropped);
+    print(f, "    \"spawners\": [");
+    for (GLuint i = 0; i < budget.CountEmitters(); ++i) {
+        const EmitterUsage usage = budget.GetUsage(i);
+        print(f, "{}\n      {{\"priority\": {}, \"quota\": {}, "
+              "\"in_flight\": {}, \"dropped\": {}}}", i ? "," : "",
+              usage.priority, usage.quota, usage.in_flight, usage.dropped);
+    }
+    println(f, "\n    ]");
+    println(f, "  }},");
+}
+
+int Bench::Report(const vector<GLuint> &live_particles) {
+    if (!cfg.enabled)
+        return 0;
+    ProfilerFlush();
+
+    FILE *f = cfg.out.empty() ? stdout : fopen(cfg.out.c_str(), "w");
+    if (!f)
+        THROW(1, "Cannot open '{}' for the benchmark report", cfg.out);
+
+    const GLuint total = accumulate(live_particles.begin(),
+                                    live_particles.end(), 0u);
+    println(f, "{{");
+    println(f, "  \"renderer\": \"{}\",",
+            (const char*)glGetString(GL_RENDERER));
+    println(f, "  \"frames\": {},", cpu_ms.size());
+    println(f, "  \"warmup\": {},", cfg.warmup);
+    println(f, "  \"dt\": {},", cfg.dt);
+    println(f, "  \"layout\": \"{}\",", layout_names[cfg.layout]);
+    println(f, "  \"backend\": \"{}\",", backend_names[cfg.backend]);
+    if (cfg.backend == PARTICLE_BACKEND_GPU)
+        println(f, "  \"atomics\": \"{}\",",
+                atomics_names[GetParticleAtomics()]);
+    println(f, "  \"particle_pool\": {},",
+            cfg.GetSpawnerConfig().particles);
+    println(f, "  \"particle_capacity\": {},", GetParticleCapacity());
+    if (cfg.backend == PARTICLE_BACKEND_GPU) {
+        println(f, "  \"reorder_interval\": {},",
+                cfg.layout_error || cfg.validate ? 0 : cfg.reorder);
+        println(f, "  \"lod_near\": {},", cfg.validate ? 0 : cfg.lod_near);
+        println(f, "  \"pipeline\": {},", cfg.pipeline);
+        println(f, "  \"culling\": {},", cfg.culling);
+        println(f, "  \"draw\": \"{}\",", draw_names[cfg.draw]);
+    }
+    println(f, "  \"spawners\": {},", live_particles.size());
+    println(f, "  \"gpu_spawners\": {},", cfg.gpu_spawners &&
+            cfg.backend == PARTICLE_BACKEND_GPU && !cfg.validate);
+    println(f, "  \"cpu_frame_ms\": {{");
+    print_stats(f, "frame", cpu_ms, true);
+    println(f, "  }},");
+    println(f, "  \"gpu_pass_ms\": {{");
+    for (GLuint i = 0; i < BENCH_PASS_NUM; ++i)
+        print_stats(f, pass_names[i], gpu_ms[i], i + 1 == BENCH_PASS_NUM);
+    println(f, "  }},");
+    if (cfg.backend == PARTICLE_BACKEND_CPU) {
+        // Updates of the final pool over the mean frame, a saturated pool
+        // (--particles) keeps its size through the measured frames
+        const unsigned int threads = cfg.threads ? cfg.threads :
+            glm::max(thread::hardware_concurrency(), 1u);
+        const double mean_ms = cpu_sim_ms.empty() ? 0 :
+            accumulate(cpu_sim_ms.begin(), cpu_sim_ms.end(), 0.0) /
+            cpu_sim_ms.size();
+        println(f, "  \"cpu_backend\": {{");
+        println(f, "    \"threads\": {},", threads);
+        println(f, "    \"avx2\": {},", ParticleSystemCPU::HasAVX2());
+        println(f, "    \"updates_per_s_per_thread\": {:.0f},",
+                mean_ms > 0 ? total / (mean_ms / 1e3) / threads : 0);
+        print_stats(f, "update_ms", cpu_sim_ms, true);
+        println(f, "  }},");
+    }
+    if (cfg.validate) {
+        println(f, "  \"cpu_reference_ms\": {{");
+        print_stats(f, "update", reference_ms, true);
+        println(f, "  }},");
+    }
+    if (cfg.budget)
+        print_budget(f, GetParticleBudget());
+    if (!GetSpawnerBounds().empty())
+        print_bounds(f, GetSpawnerBounds());
+    print(f, "  \"live_particles\": {{\"total\": {}, \"spawners\": [",
+          total);
+    for (GLuint i = 0; i < live_particles.size(); ++i)
+        print(f, "{}{}", i ? ", " : "", live_particles[i]);
+    println(f, "]}},");
+
+    const GLuint *const traffic = layout_traffic[cfg.layout];
+    const GLuint draw_out = cfg.pipeline ? sizeof(vec4) : sizeof(GLuint);
+    const GLuint sim_bytes = traffic[0] + draw_out;
+    const GLuint draw_bytes = cfg.pipeline ? draw_out :
+        draw_out + traffic[1];
+    println(f, "  \"est_bytes_per_particle\": {{\"sim\": {}, "
+            "\"draw\": {}}},", sim_bytes, draw_bytes);
+    print(f, "  \"est_traffic_mb_per_frame\": {{\"sim\": {:.2f}, "
+          "\"draw\": {:.2f}}}",
+          total * sim_bytes / 1e6, total * draw_bytes / 1e6);
+    if (cfg.backend == PARTICLE_BACKEND_GPU) {
+        // Record, free stack, both alive lists and what the simulation
+        // writes for the draw, two snapshots or one slot list. The reorder
+        // keeps a spare copy of the records
+        const GLuint record = layout_record[cfg.layout];
+        const GLuint slot_bytes = record + 3 * sizeof(GLuint) +
+            (cfg.pipeline ? 2 * sizeof(vec4) : sizeof(GLuint)) +
+            (cfg.reorder && !cfg.layout_error && !cfg.validate ? record : 0);
+        println(f, ",");
+        print(f, "  \"est_bytes_per_slot\": {}", slot_bytes);
+    }
+    if (cfg.layout_error)
+        print_error(f, "layout_error_vs_float", MeasureLayoutError());
+    const bool passed = !cfg.validate || PrintValidation(f);
+    println(f, "\n}}");
+
+    if (f != stdout)
+        fclose(f);
+    return passed ? 0 : 1;
+}
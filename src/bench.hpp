@@ -0,0 +1,107 @@
+#pragma once
+#include "objects.hpp"
+#include "profiler.hpp"
+#include "renderer.hpp"
+#include <GL/gl.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Passes are timed by the GPU zones of the same name, see pass_names
+enum BenchPass {
+    BENCH_PASS_SIM,
+    BENCH_PASS_SCENE,
+    BENCH_PASS_PARTICLES,
+    // Inside sim, only on the frames that reorder
+    BENCH_PASS_REORDER,
+    BENCH_PASS_NUM
+};
+
+struct BenchConfig {
+public:
+    bool enabled = false;
+    GLuint frames = 1000;
+    GLuint warmup = 60;
+    float dt = 1/60.0f;
+    string out;
+    // Particle pool of the scene, 0 keeps the demo's default
+    GLuint particles = 0;
+    // Slots the pool starts with before growing, 0 allocates all of them
+    GLuint initial_particles = 0;
+    // Cap on live particles split between the spawners, 0 for none
+    GLuint budget = 0;
+    // Budget priority of the first spawners
+    vector<GLuint> priorities;
+    // Spawns per second of the first spawners, 0 pauses one
+    vector<float> rates;
+    // Frames between Morton reorders of the GPU pool, 0 for none
+    GLuint reorder = 0;
+    // Double buffer a snapshot of the visible particles for the draw
+    bool pipeline = false;
+    // Temporal LOD distance of the GPU pool, 0 for none
+    float lod_near = 0;
+    // Cull the particles against the view frustum before drawing
+    bool culling = true;
+    // Reduce and read back the bounds of every spawner's particles
+    bool cloud_bounds = true;
+    // Spawners of the scene, 0 keeps the demo's default
+    GLuint spawners = 0;
+    ParticleLayout layout = PARTICLE_LAYOUT_AOS;
+    ParticleBackend backend = PARTICLE_BACKEND_GPU;
+    ParticleAtomics atomics = PARTICLE_ATOMICS_AUTO;
+    ParticleDraw draw = PARTICLE_DRAW_MESH;
+    // Worker threads of the CPU backend, 0 picks the core count
+    unsigned int threads = 0;
+    // Step the spawners on the GPU
+    bool gpu_spawners = false;
+    // Measure the layout's error against a float AoS copy of the pools
+    bool layout_error = false;
+    // Chrome trace written at exit, also enables the profiler
+    string trace;
+    // Run the CPU reference next to the pool and compare them at the end
+    bool validate = false;
+
+    SpawnerConfig GetSpawnerConfig() const;
+};
+
+class Bench {
+public:
+    Bench(const BenchConfig &);
+    Bench(const Bench &) = delete;
+    ~Bench();
+    /**
+    * \brief Parses `--bench` and its options from the command line
+    * \return zero if the arguments are valid
+    */
+    static int ParseArgs(const int, const char *const *, BenchConfig *);
+    bool IsEnabled() const;
+    bool IsDone() const;
+    /**
+    * \return the fixed timestep when benchmarking, wall-clock dt otherwise
+    */
+    float GetDT() const;
+    void BeginFrame();
+    void EndFrame();
+    /**
+    * \brief Writes the JSON report
+    * \param live_particles live particle count of every spawner
+    * \return zero if the report was written and the validation passed
+    */
+    int Report(const vector<GLuint> &);
+private:
+    void CollectZone(const ProfileEvent &);
+    bool PrintValidation(FILE *) const;
+private:
+    BenchConfig cfg;
+    GLuint frame = 0;
+    // First profiler frame past the warmup
+    GLuint measure_from = 0;
+    vector<double> cpu_ms;
+    vector<double> gpu_ms[BENCH_PASS_NUM];
+    vector<double> reference_ms;
+    vector<double> cpu_sim_ms;
+    chrono::steady_clock::time_point frame_start;
+};
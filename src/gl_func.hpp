@@ -8,9 +8,19 @@
 DEF(PFNGLGENBUFFERSPROC,    glGenBuffers);
 DEF(PFNGLBINDBUFFERPROC,    glBindBuffer);
 DEF(PFNGLBUFFERDATAPROC,    glBufferData);
+DEF(PFNGLBUFFERSUBDATAPROC, glBufferSubData);
 DEF(PFNGLMAPBUFFERPROC,     glMapBuffer);
 DEF(PFNGLUNMAPBUFFERPROC,   glUnmapBuffer);
 DEF(PFNGLDELETEBUFFERSPROC, glDeleteBuffers);
+DEF(PFNGLBUFFERSTORAGEPROC, glBufferStorage);
+DEF(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange);
+DEF(PFNGLBINDBUFFERRANGEPROC, glBindBufferRange);
+DEF(PFNGLCOPYBUFFERSUBDATAPROC, glCopyBufferSubData);
+DEF(PFNGLCLEARBUFFERDATAPROC, glClearBufferData);
+
+DEF(PFNGLFENCESYNCPROC,      glFenceSync);
+DEF(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+DEF(PFNGLDELETESYNCPROC,     glDeleteSync);
 
 DEF(PFNGLGENVERTEXARRAYSPROC,         glGenVertexArrays);
 DEF(PFNGLBINDVERTEXARRAYPROC,         glBindVertexArray);
@@ -18,6 +28,8 @@ DEF(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
 DEF(PFNGLVERTEXATTRIBPOINTERPROC,     glVertexAttribPointer);
 DEF(PFNGLDELETEVERTEXARRAYSPROC,      glDeleteVertexArrays);
 DEF(PFNGLDRAWELEMENTSINDIRECTPROC,    glDrawElementsIndirect);
+DEF(PFNGLDRAWARRAYSINDIRECTPROC,      glDrawArraysIndirect);
+DEF(PFNGLMULTIDRAWELEMENTSINDIRECTPROC, glMultiDrawElementsIndirect);
 DEF(PFNGLDRAWELEMENTSINSTANCEDPROC,   glDrawElementsInstanced);
 
 DEF(PFNGLCREATESHADERPROC,     glCreateShader);
@@ -34,6 +46,9 @@ DEF(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
 DEF(PFNGLATTACHSHADERPROC,      glAttachShader);
 DEF(PFNGLLINKPROGRAMPROC,       glLinkProgram);
 DEF(PFNGLDELETEPROGRAMPROC,     glDeleteProgram);
+DEF(PFNGLGETPROGRAMBINARYPROC,   glGetProgramBinary);
+DEF(PFNGLPROGRAMBINARYPROC,      glProgramBinary);
+DEF(PFNGLPROGRAMPARAMETERIPROC,  glProgramParameteri);
 
 DEF(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
 DEF(PFNGLUNIFORMMATRIX4FVPROC,   glUniformMatrix4fv);
@@ -42,15 +57,26 @@ DEF(PFNGLUNIFORM1FVPROC,         glUniform1fv);
 DEF(PFNGLUNIFORM3FPROC,          glUniform3f);
 DEF(PFNGLUNIFORM3FVPROC,         glUniform3fv);
 DEF(PFNGLUNIFORM1UIPROC,         glUniform1ui);
+DEF(PFNGLUNIFORM1UIVPROC,        glUniform1uiv);
 DEF(PFNGLUNIFORM1IPROC,          glUniform1i);
 DEF(PFNGLGENERATEMIPMAPPROC,     glGenerateMipmap);
 
 DEF(PFNGLTEXSTORAGE2DPROC,     glTexStorage2D);
 DEF(PFNGLBINDIMAGETEXTUREPROC, glBindImageTexture);
 DEF(PFNGLDISPATCHCOMPUTEPROC,  glDispatchCompute);
+DEF(PFNGLDISPATCHCOMPUTEINDIRECTPROC, glDispatchComputeIndirect);
 DEF(PFNGLMEMORYBARRIERPROC,    glMemoryBarrier);
 DEF(PFNGLBINDBUFFERBASEPROC,   glBindBufferBase);
 
+DEF(PFNGLGENQUERIESPROC,          glGenQueries);
+DEF(PFNGLDELETEQUERIESPROC,       glDeleteQueries);
+DEF(PFNGLBEGINQUERYPROC,          glBeginQuery);
+DEF(PFNGLENDQUERYPROC,            glEndQuery);
+DEF(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);
+DEF(PFNGLQUERYCOUNTERPROC,        glQueryCounter);
+DEF(PFNGLGETINTEGER64VPROC,        glGetInteger64v);
+DEF(PFNGLGETSTRINGIPROC,           glGetStringi);
+
 DEF(PFNGLDEBUGMESSAGECALLBACKPROC, glDebugMessageCallback);
 DEF(PFNGLDEBUGMESSAGECONTROLPROC,  glDebugMessageControl);
 #undef DEF
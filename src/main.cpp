@@ -1,37 +1,59 @@
 #include "application.hpp"
+#include "bench.hpp"
 #include "logger.hpp"
 #include "objects.hpp"
+#include "profiler.hpp"
+#include "render_graph.hpp"
 #include "renderer.hpp"
 #include "flower_img.c"
 #include <GL/gl.h>
 #include <GL/glext.h>
+#include <GLFW/glfw3.h>
 #include <memory>
 #include <vector>
 
 #define IMG_SIZE 256
+// Trace written by the dump key without --trace
+#define DEFAULT_TRACE "flower_trace.json"
 
-void GenTextures(Texture *tex) {
+void GenTextures(RenderGraph *graph, Texture *tex) {
     Program tex_generator({2}, {GL_COMPUTE_SHADER});
-    tex_generator.Use();
-    tex_generator.Dispatch({tex},
-                           {IMG_SIZE, 1, 1});
-    tex_generator.FinishComputes();
+    const GLuint res = graph->Import("floor_tex", GRAPH_RESOURCE_TEXTURE);
+    graph->AddPass("texgen", {GraphWrite(res, GRAPH_ACCESS_IMAGE)}, [&]() {
+        tex_generator.Use();
+        tex_generator.Dispatch({tex},
+                               {IMG_SIZE, 1, 1});
+    });
+    // The mipmaps are made from the base level the image stores wrote
+    graph->AddPass("mipmap", {
+        GraphRead(res, GRAPH_ACCESS_SAMPLE),
+        GraphWrite(res, GRAPH_ACCESS_TRANSFER),
+    }, [&]() {
+        tex->GenerateMipMap();
+    });
+    graph->Execute();
 }
 
-int main() {
+int main(int argc, char **argv) {
+    BenchConfig bench_cfg;
+    if (Bench::ParseArgs(argc, argv, &bench_cfg))
+        return 1;
+
     // Create window
-    if (CreateWindow())
+    if (CreateWindow(bench_cfg.enabled))
         return 1;
+    ProfilerInit(bench_cfg.enabled || !bench_cfg.trace.empty(),
+                 bench_cfg.enabled);
+    // Passes of a frame, only the barriers they need between them. Imports
+    // keep their ids, so they're looked up once
+    RenderGraph frame_graph;
+    const GLuint floor_res = frame_graph.Import("floor_tex",
+                                                GRAPH_RESOURCE_TEXTURE);
+    const GLuint particle_res = frame_graph.Import("particles",
+                                                   GRAPH_RESOURCE_BUFFER);
     // Generate the floor texture
     Texture floor_tex(IMG_SIZE, IMG_SIZE, 0, 3);
-    GenTextures(&floor_tex);
-    floor_tex.GenerateMipMap();
-
-    // Basic shader programs 
-    shared_ptr<Program> tex_prog =
-        make_shared<Program>(
-            vector<GLuint>({0, 3}),
-            vector<GLuint>({GL_VERTEX_SHADER, GL_FRAGMENT_SHADER}));
+    GenTextures(&frame_graph, &floor_tex);
 
     // Allocate data for meshes
     vector<GLuint> quad_elems = {
@@ -51,28 +73,69 @@ int main() {
         {{-250, -.5,-250}, {0, 250}},
     };
 
-    // Generate meshes using the previous data
-    Mesh tex_mesh(tex_verts, quad_elems, tex_prog);
-    Mesh floor_mesh(verts, quad_elems, tex_prog);
+    // Both textured meshes go out in one multi draw
+    MeshBatch scene(3);
+    scene.Add(verts, quad_elems);
+    scene.Add(tex_verts, quad_elems);
 
     // Create Spawners
-    CreateSpawners();
+    CreateSpawners(bench_cfg.GetSpawnerConfig());
+    const GraphAccess particle_access = GetParticleAccess();
 
     // Game loop
-    while (UpdateWindow()) {
-        // Update physics and interactions
-        const float dt = GetDT();
-        UpdatePlayer(dt);
-        UpdateSpawners(dt);
+    Bench bench(bench_cfg);
+    bool was_dump_down = false;
+    while (UpdateWindow() && !bench.IsDone()) {
+        ProfilerBeginFrame();
+        bench.BeginFrame();
+        {
+            PROFILE_CPU("frame");
+            // Update physics and interactions
+            const float dt = bench.GetDT();
+            UpdatePlayer(dt);
+            frame_graph.AddPass("sim",
+                                {GraphWrite(particle_res, particle_access)},
+                                [dt]() {
+                PROFILE_GPU("sim");
+                UpdateSpawners(dt);
+            });
+
+            // Rendering, the scene doesn't wait for the simulation's writes
+            frame_graph.AddPass("scene",
+                                {GraphRead(floor_res, GRAPH_ACCESS_SAMPLE)},
+                                [&]() {
+                PROFILE_GPU("scene");
+                floor_tex.Use(0);
+                scene.Draw();
+            });
+            frame_graph.AddPass("particles",
+                                {GraphRead(particle_res, GRAPH_ACCESS_SSBO)},
+                                []() {
+                PROFILE_GPU("particles");
+                DrawSpawners();
+            });
+            frame_graph.Execute();
+            Render();
+        }
+        bench.EndFrame();
+
+        // Dump what the ring holds so far on demand
+        const bool dump_down = IsKeyDown(GLFW_KEY_F2);
+        if (dump_down && !was_dump_down && ProfilerIsEnabled())
+            ProfilerDump(bench_cfg.trace.empty() ?
+                         DEFAULT_TRACE : bench_cfg.trace.c_str());
+        was_dump_down = dump_down;
+    }
 
-        // Rendering
-        floor_tex.Use(0);
-        floor_mesh.Draw();
-        tex_mesh.Draw();
-        DrawSpawners();
-        Render();
+    int ret = 0;
+    if (bench.IsEnabled())
+        ret = bench.Report(CountSpawnerParticles());
+    if (!bench_cfg.trace.empty()) {
+        ProfilerFlush();
+        ret |= ProfilerDump(bench_cfg.trace.c_str());
     }
+    ProfilerShutdown();
     // Close everything
     CloseWindow();
-    return 0;
+    return ret;
 }
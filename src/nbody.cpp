@@ -0,0 +1,353 @@
+#include "nbody.hpp"
+#include "thread_pool.hpp"
+#include "glm/common.hpp"
+#include "glm/ext/vector_float3.hpp"
+#include <GL/gl.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NBODY_X86
+#endif
+
+// Bodies per octree leaf, summed directly once a leaf is opened
+#define NBODY_LEAF_SIZE 32
+// Bodies that share one tree walk. Larger groups walk less often but sum
+// longer interaction lists
+#define NBODY_GROUP_SIZE 64
+#define NBODY_MAX_DEPTH 24
+// Bodies per task
+#define NBODY_GRAIN 256
+
+using namespace glm;
+using namespace std;
+
+// INFO: bodies or octree cells as SoA, what a body interacts with
+struct Sources {
+    const float *x;
+    const float *y;
+    const float *z;
+    const float *mass;
+    size_t len;
+};
+
+/**
+ * \brief Sum of the pull of every source on p
+ */
+static vec3 accel_scalar(const vec3 p, const Sources &src, const float g,
+                         const float eps2) {
+    vec3 acc(0);
+    for (size_t j = 0; j < src.len; ++j) {
+        const float dx = src.x[j] - p.x;
+        const float dy = src.y[j] - p.y;
+        const float dz = src.z[j] - p.z;
+        const float d2 = dx*dx + dy*dy + dz*dz;
+        // Self and bodies on top of each other have no direction
+        if (d2 <= 0)
+            continue;
+        const float s = g * src.mass[j] / ((d2 + eps2) * sqrt(d2));
+        acc += vec3(dx, dy, dz) * s;
+    }
+    return acc;
+}
+
+#ifdef NBODY_X86
+/**
+ * \brief accel_scalar 8 sources at a time
+ */
+__attribute__((target("avx2,fma")))
+static vec3 accel_avx2(const vec3 p, const Sources &src, const float g,
+                       const float eps2) {
+    const __m256 px = _mm256_set1_ps(p.x);
+    const __m256 py = _mm256_set1_ps(p.y);
+    const __m256 pz = _mm256_set1_ps(p.z);
+    const __m256 vg = _mm256_set1_ps(g);
+    const __m256 veps2 = _mm256_set1_ps(eps2);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 ax = zero, ay = zero, az = zero;
+
+    size_t j = 0;
+    for (; j + 8 <= src.len; j += 8) {
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(src.x + j), px);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(src.y + j), py);
+        const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(src.z + j), pz);
+        const __m256 d2 = _mm256_fmadd_ps(dx, dx,
+            _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+        __m256 s = _mm256_div_ps(
+            _mm256_mul_ps(vg, _mm256_loadu_ps(src.mass + j)),
+            _mm256_mul_ps(_mm256_add_ps(d2, veps2), _mm256_sqrt_ps(d2)));
+        s = _mm256_and_ps(s, _mm256_cmp_ps(d2, zero, _CMP_GT_OQ));
+        ax = _mm256_fmadd_ps(dx, s, ax);
+        ay = _mm256_fmadd_ps(dy, s, ay);
+        az = _mm256_fmadd_ps(dz, s, az);
+    }
+
+    float sx[8], sy[8], sz[8];
+    _mm256_storeu_ps(sx, ax);
+    _mm256_storeu_ps(sy, ay);
+    _mm256_storeu_ps(sz, az);
+    vec3 acc(0);
+    for (GLuint k = 0; k < 8; ++k)
+        acc += vec3(sx[k], sy[k], sz[k]);
+
+    const Sources tail = {src.x + j, src.y + j, src.z + j, src.mass + j,
+                          src.len - j};
+    return acc + accel_scalar(p, tail, g, eps2);
+}
+#endif
+
+static bool has_avx2() {
+#ifdef NBODY_X86
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+/**
+ * \brief Splits order[first, first + count) into octants and recurses,
+ * masses and centers of mass are summed on the way back up
+ */
+static void build_node(NBodyWorkspace &tree, const NBodyBodies &b,
+                       const GLuint idx, const GLuint depth) {
+    NBodyNode node = tree.nodes[idx];
+    if (node.count <= NBODY_LEAF_SIZE || depth == NBODY_MAX_DEPTH) {
+        vec3 weighted(0);
+        node.mass = 0;
+        for (GLuint k = node.first; k < node.first + node.count; ++k) {
+            const GLuint j = tree.order[k];
+            weighted += vec3(b.x[j], b.y[j], b.z[j]) * b.mass[j];
+            node.mass += b.mass[j];
+        }
+        node.com = node.mass > 0 ? weighted / node.mass : node.center;
+        node.child = -1;
+        tree.nodes[idx] = node;
+        return;
+    }
+
+    // Counting sort of the node's bodies by octant
+    GLuint counts[8] = {};
+    auto octant = [&](const GLuint j) {
+        return (b.x[j] >= node.center.x ? 1 : 0) |
+               (b.y[j] >= node.center.y ? 2 : 0) |
+               (b.z[j] >= node.center.z ? 4 : 0);
+    };
+    for (GLuint k = node.first; k < node.first + node.count; ++k)
+        ++counts[octant(tree.order[k])];
+    GLuint starts[8];
+    for (GLuint o = 0, sum = node.first; o < 8; ++o) {
+        starts[o] = sum;
+        sum += counts[o];
+    }
+    GLuint cursor[8];
+    copy(starts, starts + 8, cursor);
+    for (GLuint k = node.first; k < node.first + node.count; ++k)
+        tree.scratch[cursor[octant(tree.order[k])]++] = tree.order[k];
+    copy(tree.scratch.begin() + node.first,
+         tree.scratch.begin() + node.first + node.count,
+         tree.order.begin() + node.first);
+
+    node.child = tree.nodes.size();
+    const float half = node.half / 2;
+    for (GLuint o = 0; o < 8; ++o) {
+        NBodyNode child = {};
+        child.center = node.center + vec3(o & 1 ? half : -half,
+                                          o & 2 ? half : -half,
+                                          o & 4 ? half : -half);
+        child.half = half;
+        child.first = starts[o];
+        child.count = counts[o];
+        tree.nodes.push_back(child);
+    }
+
+    vec3 weighted(0);
+    node.mass = 0;
+    for (GLuint o = 0; o < 8; ++o) {
+        const GLuint c = node.child + o;
+        if (tree.nodes[c].count)
+            build_node(tree, b, c, depth + 1);
+        weighted += tree.nodes[c].com * tree.nodes[c].mass;
+        node.mass += tree.nodes[c].mass;
+    }
+    node.com = node.mass > 0 ? weighted / node.mass : node.center;
+    tree.nodes[idx] = node;
+}
+
+static void build_octree(NBodyWorkspace &tree, const NBodyBodies &b) {
+    const GLuint n = b.x.size();
+    vec3 lo(b.x[0], b.y[0], b.z[0]), hi = lo;
+    for (GLuint j = 1; j < n; ++j) {
+        lo = glm::min(lo, vec3(b.x[j], b.y[j], b.z[j]));
+        hi = glm::max(hi, vec3(b.x[j], b.y[j], b.z[j]));
+    }
+    const vec3 extent = hi - lo;
+
+    tree.order.resize(n);
+    tree.scratch.resize(n);
+    for (GLuint j = 0; j < n; ++j)
+        tree.order[j] = j;
+    tree.nodes.clear();
+    tree.nodes.reserve(2 * n / NBODY_LEAF_SIZE * 8 / 7 + 8);
+
+    NBodyNode root = {};
+    root.center = (lo + hi) / 2.0f;
+    root.half = glm::max(glm::max(extent.x, extent.y), extent.z) / 2 + 1e-3f;
+    root.count = n;
+    tree.nodes.push_back(root);
+    build_node(tree, b, 0, 0);
+}
+
+// INFO: sources of one group's interaction list
+struct InteractionList {
+    vector<float> x;
+    vector<float> y;
+    vector<float> z;
+    vector<float> mass;
+
+    void Clear() {
+        x.clear();
+        y.clear();
+        z.clear();
+        mass.clear();
+    }
+    void Push(const float px, const float py, const float pz,
+              const float m) {
+        x.push_back(px);
+        y.push_back(py);
+        z.push_back(pz);
+        mass.push_back(m);
+    }
+    Sources Get() const {
+        return {x.data(), y.data(), z.data(), mass.data(), x.size()};
+    }
+};
+
+/**
+ * \brief Finds the largest nodes of at most NBODY_GROUP_SIZE bodies, and
+ * leaves that hold more, so every body is in exactly one group
+ */
+static void collect_groups(NBodyWorkspace &tree) {
+    tree.groups.clear();
+    GLuint stack[NBODY_MAX_DEPTH * 8 + 1];
+    GLuint top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const GLuint idx = stack[--top];
+        const NBodyNode &node = tree.nodes[idx];
+        if (!node.count)
+            continue;
+        if (node.child < 0 || node.count <= NBODY_GROUP_SIZE)
+            tree.groups.push_back(idx);
+        else
+            for (GLuint o = 0; o < 8; ++o)
+                stack[top++] = node.child + o;
+    }
+}
+
+/**
+ * \brief Barnes-Hut walk shared by every body of a group. Cells far enough
+ * from the whole group act as one body, opened leaves add their bodies
+ */
+static void gather_interactions(const NBodyWorkspace &tree,
+                                const NBodyNode &group,
+                                InteractionList &list) {
+    const NBodyBodies &sorted = tree.sorted;
+    list.Clear();
+    vec3 lo(sorted.x[group.first], sorted.y[group.first],
+            sorted.z[group.first]);
+    vec3 hi = lo;
+    for (GLuint k = group.first + 1; k < group.first + group.count; ++k) {
+        lo = glm::min(lo, vec3(sorted.x[k], sorted.y[k], sorted.z[k]));
+        hi = glm::max(hi, vec3(sorted.x[k], sorted.y[k], sorted.z[k]));
+    }
+
+    GLuint stack[NBODY_MAX_DEPTH * 8 + 1];
+    GLuint top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const NBodyNode &node = tree.nodes[stack[--top]];
+        if (node.mass <= 0)
+            continue;
+        // Distance from the cell's center of mass to the group's bounds
+        const vec3 d = glm::max(glm::max(lo - node.com, node.com - hi),
+                                vec3(0));
+        const float d2 = d.x*d.x + d.y*d.y + d.z*d.z;
+        const float size = 2 * node.half;
+        if (size*size < NBODY_THETA*NBODY_THETA * d2)
+            list.Push(node.com.x, node.com.y, node.com.z, node.mass);
+        else if (node.child < 0)
+            for (GLuint k = node.first; k < node.first + node.count; ++k)
+                list.Push(sorted.x[k], sorted.y[k], sorted.z[k],
+                          sorted.mass[k]);
+        else
+            for (GLuint o = 0; o < 8; ++o)
+                stack[top++] = node.child + o;
+    }
+}
+
+void ComputeAccelerations(const NBodyBodies &bodies, const float g,
+                          const float eps, NBodyWorkspace *work,
+                          vector<vec3> *acc, ThreadPool *pool) {
+    const GLuint n = bodies.x.size();
+    acc->assign(n, vec3(0));
+    if (n == 0)
+        return;
+    const float eps2 = eps * eps;
+    auto accel = has_avx2() ?
+#ifdef NBODY_X86
+        accel_avx2 :
+#endif
+        accel_scalar;
+    auto parallel_for = [&](const size_t len, const size_t grain,
+                            const function<void(size_t, size_t)> &func) {
+        if (pool)
+            pool->ParallelFor(len, grain, func);
+        else
+            func(0, len);
+    };
+
+    if (n < NBODY_OCTREE_THRESHOLD) {
+        const Sources all = {bodies.x.data(), bodies.y.data(),
+                             bodies.z.data(), bodies.mass.data(), n};
+        parallel_for(n, NBODY_GRAIN, [&](const size_t begin,
+                                         const size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                (*acc)[i] = accel(vec3(bodies.x[i], bodies.y[i],
+                                       bodies.z[i]), all, g, eps2);
+        });
+        return;
+    }
+
+    NBodyWorkspace &tree = *work;
+    build_octree(tree, bodies);
+    NBodyBodies &sorted = tree.sorted;
+    sorted.x.resize(n);
+    sorted.y.resize(n);
+    sorted.z.resize(n);
+    sorted.mass.resize(n);
+    for (GLuint k = 0; k < n; ++k) {
+        const GLuint j = tree.order[k];
+        sorted.x[k] = bodies.x[j];
+        sorted.y[k] = bodies.y[j];
+        sorted.z[k] = bodies.z[j];
+        sorted.mass[k] = bodies.mass[j];
+    }
+    collect_groups(tree);
+
+    parallel_for(tree.groups.size(), NBODY_GRAIN / NBODY_GROUP_SIZE,
+                 [&](const size_t begin, const size_t end) {
+        InteractionList list;
+        for (size_t i = begin; i < end; ++i) {
+            const NBodyNode &group = tree.nodes[tree.groups[i]];
+            gather_interactions(tree, group, list);
+            const Sources src = list.Get();
+            for (GLuint k = group.first; k < group.first + group.count; ++k)
+                (*acc)[tree.order[k]] = accel(
+                    vec3(sorted.x[k], sorted.y[k], sorted.z[k]),
+                    src, g, eps2);
+        }
+    });
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "thread_pool.hpp"
+#include "glm/ext/vector_float3.hpp"
+#include <GL/gl.h>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+// Bodies from which the octree replaces the direct O(n^2) sum
+#define NBODY_OCTREE_THRESHOLD 512
+// Cell size over distance below which a cell acts as one body
+#define NBODY_THETA 0.5f
+
+// INFO: bodies as SoA so the direct sum vectorizes
+struct NBodyBodies {
+public:
+    vector<float> x;
+    vector<float> y;
+    vector<float> z;
+    vector<float> mass;
+};
+
+struct NBodyNode {
+public:
+    vec3 com;
+    float mass;
+    vec3 center;
+    float half;
+    // Bodies order[first, first + count), children are 8 nodes from child
+    GLuint first;
+    GLuint count;
+    GLint child;
+};
+
+// INFO: scratch of ComputeAccelerations, owned by the caller so steps
+// reuse the allocations and independent callers don't share state
+struct NBodyWorkspace {
+public:
+    // Barnes-Hut octree, order maps tree order to body index
+    vector<NBodyNode> nodes;
+    vector<GLuint> order;
+    vector<GLuint> scratch;
+    // Bodies in tree order, every node's bodies are contiguous
+    NBodyBodies sorted;
+    // Nodes whose bodies share one tree walk
+    vector<GLuint> groups;
+};
+
+/**
+* \brief Softened gravity of every body on every other one,
+* g * m_j * dir / (dst^2 + eps^2). Exact below NBODY_OCTREE_THRESHOLD
+* bodies, Barnes-Hut above it
+* \param bodies positions and masses
+* \param g gravitational constant
+* \param eps softening length
+* \param work scratch, only one call may use it at a time
+* \param acc receives the acceleration of every body
+* \param pool splits the bodies across threads, may be null
+*/
+void ComputeAccelerations(const NBodyBodies &, const float, const float,
+                          NBodyWorkspace *, vector<vec3> *, ThreadPool *);
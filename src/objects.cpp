@@ -1,6 +1,12 @@
 #include "objects.hpp"
 #include "renderer.hpp"
 #include "application.hpp"
+#include "nbody.hpp"
+#include "particle_budget.hpp"
+#include "particle_cpu.hpp"
+#include "particle_ref.hpp"
+#include "profiler.hpp"
+#include "logger.hpp"
 #include "glm/common.hpp"
 #include "glm/ext/scalar_constants.hpp"
 #include "glm/ext/vector_float2.hpp"
@@ -14,24 +20,48 @@
 #include <cmath>
 #include <cstdlib>
 #include <memory>
+#include <string>
 #include <vector>
 
 #define SPEED 2
 #define SENSITIVITY .7
 #define MAX_DST 100
-#define SPAWNER_NUM 3
 #define FARTHEST_SPAWNER 5
 #define G 6.67
 #define GRAV 0.5f
 #define EPSILON 50
 #define MAX_SPAWNER_VEL 5
+#define SPAWN_TIME 0.001f
+#define PARTICLE_LIFE 7
+// init_particle varies the lifetime by up to a second either way
+#define PARTICLE_MAX_LIFE (PARTICLE_LIFE + 1)
+// Spawners from which their gravity is split across threads
+#define SPAWNER_THREADS_MIN 256
 
 struct Spawners {
 public:
-    vec3 pos[SPAWNER_NUM];
-    vec3 vel[SPAWNER_NUM];
-    float mass[SPAWNER_NUM];
-    unique_ptr<ParticleSystem> particles[SPAWNER_NUM];
+    GLuint num = 0;
+    vector<vec3> pos;
+    vector<vec3> vel;
+    vector<float> mass;
+    // Scratch of the gravity step
+    NBodyBodies bodies;
+    NBodyWorkspace nbody;
+    vector<vec3> acc;
+    unique_ptr<ThreadPool> pool;
+    // Replaces the CPU step when the spawners live on the GPU
+    unique_ptr<SpawnerState> gpu;
+    // One pool shared by every spawner, particles record their spawner
+    unique_ptr<ParticlePool> particles;
+    // The same pool when it runs on the GPU, else null
+    ParticleSystem *gpu_particles = nullptr;
+    unique_ptr<ParticleSystem> shadow;
+    unique_ptr<ParticleReference> reference;
+    // Schedules the spawns of every spawner, shared by all pools
+    unique_ptr<ParticleBudget> budget;
+    vector<GLuint> spawn_ends;
+    // Counter aggregation the GPU pools run
+    ParticleAtomics atomics = PARTICLE_ATOMICS_AUTO;
 };
 
 static bool was_space_down = false;
@@ -116,8 +146,7 @@ void UpdatePlayer(const float dt) {
     LoopPlayerPos();
 
     if (IsKeyDown(GLFW_KEY_F1)) {
-        for (int i = 0; i < SPAWNER_NUM; ++i)
-            spawners.particles[i]->PrintParticles();
+        spawners.particles->PrintParticles();
         exit(1);
     }
 }
@@ -140,22 +169,23 @@ static vec3 RandomRange(vec3 min, vec3 max) {
     );
 }
 
-static void CreateSpawner(const GLuint i, const vector<Vertex> &particle_verts,
-                          const vector<GLuint> &particle_elems) {
-    shared_ptr<Program> particle_prog = make_shared<Program>(
-        vector<GLuint>({5, 7}),
-        vector<GLuint>({GL_VERTEX_SHADER, GL_FRAGMENT_SHADER}));
-    unique_ptr<Mesh> particle_mesh = make_unique<Mesh>(
-            particle_verts, particle_elems, particle_prog);
+/**
+ * \return the constants of the CPU step as defines for spawner.comp
+ */
+static string SpawnerDefines() {
+    return "#define SPAWNER_G " + to_string((float)G) + "\n"
+        "#define SPAWNER_GRAV " + to_string((float)GRAV) + "\n"
+        "#define SPAWNER_EPSILON " + to_string((float)EPSILON) + "\n"
+        "#define SPAWNER_MAX_VEL " + to_string((float)MAX_SPAWNER_VEL) + "\n";
+}
 
+static void CreateSpawner(const GLuint i) {
     spawners.pos[i] = RandomRange(vec3(-30, 1, -30), vec3(30, 1, 30));
     spawners.vel[i] = RandomRange(vec3(-3, 1, -3), vec3(3, 1, 3));
     spawners.mass[i] = RandomRange(49, 51);
-    spawners.particles[i] = make_unique<ParticleSystem>(
-            std::move(particle_mesh), 1000000);
 }
 
-void CreateSpawners() {
+void CreateSpawners(const SpawnerConfig &cfg) {
     vector<GLuint> particle_elems = {
         0, 1, 2, 2, 3, 0
     };
@@ -168,25 +198,84 @@ void CreateSpawners() {
     // Using MipMaps here causes BUG
     particle_tex = make_unique<Texture>((char*)&flower_src, 0, 0);
 
-    for (unsigned int i = 0; i < SPAWNER_NUM; ++i)
-        CreateSpawner(i, particle_verts, particle_elems);
-}
+    spawners.num = glm::max(cfg.spawners, 1u);
+    spawners.pos.resize(spawners.num);
+    spawners.vel.resize(spawners.num);
+    spawners.mass.resize(spawners.num);
+    for (unsigned int i = 0; i < spawners.num; ++i)
+        CreateSpawner(i);
 
-static void UpdateSpawnerVel(const uint i, const float grav_const, const float dt, const float time_const) {
-    for (unsigned int j = 0; j < SPAWNER_NUM; ++j) {
-        if (i == j) 
-            continue;
-        const float dst = distance(spawners.pos[i], spawners.pos[j]);
-        float force = (grav_const*spawners.mass[j]) /
-            (pow(dst, 2) + pow(EPSILON, 2));
-        const vec3 dir = normalize(spawners.pos[j]-spawners.pos[i]);
-        force *= dt/spawners.mass[i];
-        spawners.vel[i] += dir*force;
+    const float spawn_time = cfg.saturate ?
+        (float)PARTICLE_LIFE * spawners.num / cfg.particles : SPAWN_TIME;
+    spawners.budget = make_unique<ParticleBudget>(
+        cfg.budget ? glm::min(cfg.budget, cfg.particles) : cfg.particles,
+        spawners.num, spawn_time, PARTICLE_MAX_LIFE, cfg.budget > 0);
+    for (GLuint i = 0; i < cfg.priorities.size() && i < spawners.num; ++i)
+        spawners.budget->SetPriority(i, cfg.priorities[i]);
+    for (GLuint i = 0; i < cfg.rates.size() && i < spawners.num; ++i) {
+        const float rate = cfg.rates[i];
+        if (rate < 0 || isnan(rate))
+            ERR("Spawner {} can't spawn {} particles per second, keeping "
+                "its default rate", i, rate);
+        else
+            spawners.budget->SetSpawnTime(i, rate > 0 ? 1 / rate : INFINITY);
+    }
 
-        spawners.vel[i] -= normalize(
-            vec3(spawners.pos[i].x, 2, spawners.pos[i].z)) *
-            time_const;
+    if (cfg.gpu_spawners &&
+        (cfg.backend != PARTICLE_BACKEND_GPU || cfg.reference))
+        ERR("GPU spawners need the GPU backend and no reference, "
+            "stepping them on the CPU");
+    else if (cfg.gpu_spawners)
+        spawners.gpu = make_unique<SpawnerState>(
+            spawners.pos.data(), spawners.vel.data(), spawners.mass.data(),
+            spawners.num, SpawnerDefines());
+    if (!spawners.gpu && spawners.num >= SPAWNER_THREADS_MIN)
+        spawners.pool = make_unique<ThreadPool>(cfg.threads);
+
+    // Draws from the snapshot the simulation writes, whatever the layout.
+    // The GPU pool builds its own program when the draw decodes the pool
+    shared_ptr<Program> particle_prog = make_shared<Program>(
+        vector<GLuint>({5, 7}),
+        vector<GLuint>({GL_VERTEX_SHADER, GL_FRAGMENT_SHADER}));
+    if (cfg.backend == PARTICLE_BACKEND_GPU)
+        spawners.atomics = ParticleSystem::PickAtomics(cfg.atomics);
+    if (cfg.backend == PARTICLE_BACKEND_CPU)
+        spawners.particles = make_unique<ParticleSystemCPU>(cfg.particles,
+                                                            cfg.threads);
+    else {
+        auto particles = make_unique<ParticleSystem>(
+            make_unique<Mesh>(particle_verts, particle_elems, particle_prog),
+            cfg.particles, cfg.layout, spawners.gpu.get(),
+            cfg.initial_particles, spawners.atomics);
+        if (cfg.reorder && (cfg.shadow_float || cfg.reference))
+            ERR("Reordering moves particles between slots, which the "
+                "shadow and the reference compare by, not reordering");
+        else
+            particles->SetReorderInterval(cfg.reorder);
+        if (cfg.lod_near > 0 && cfg.reference)
+            ERR("The reference has no temporal LOD, updating every "
+                "particle every frame");
+        else
+            particles->SetLODDistance(cfg.lod_near);
+        particles->SetCulling(cfg.culling);
+        particles->SetBoundsReadback(cfg.cloud_bounds);
+        particles->SetDrawMode(cfg.draw);
+        particles->SetPipelining(cfg.pipeline);
+        spawners.gpu_particles = particles.get();
+        spawners.particles = std::move(particles);
     }
+    // Never drawn, so it can share the program of the real pool. It runs
+    // the same LOD, so only the layout differs
+    if (cfg.shadow_float && cfg.backend == PARTICLE_BACKEND_GPU) {
+        spawners.shadow = make_unique<ParticleSystem>(
+            make_unique<Mesh>(particle_verts, particle_elems, particle_prog),
+            cfg.particles, PARTICLE_LAYOUT_AOS, spawners.gpu.get(), 0,
+            spawners.atomics);
+        if (!cfg.reference)
+            spawners.shadow->SetLODDistance(cfg.lod_near);
+    }
+    if (cfg.reference)
+        spawners.reference = make_unique<ParticleReference>(cfg.particles);
 }
 
 static void ClampV3(vec3 *v) {
@@ -198,26 +287,190 @@ static void ClampV3(vec3 *v) {
     }
 }
 
-static void UpdateSpawner(const uint i, const float dt) {
-    spawners.pos[i] += spawners.vel[i] * dt;
-    UpdateSpawnerVel(i, G*spawners.mass[i], dt, GRAV*dt);
-    ClampV3(spawners.vel + i);
+/**
+ * \brief Moves every spawner, then applies the gravity of the others and
+ * the pull towards the center. The gravity is exact for few spawners and
+ * Barnes-Hut for thousands
+ */
+static void MoveSpawners(const float dt) {
+    const GLuint n = spawners.num;
+    NBodyBodies &bodies = spawners.bodies;
+    bodies.x.resize(n);
+    bodies.y.resize(n);
+    bodies.z.resize(n);
+    bodies.mass.assign(spawners.mass.begin(), spawners.mass.end());
+    for (GLuint i = 0; i < n; ++i) {
+        spawners.pos[i] += spawners.vel[i] * dt;
+        bodies.x[i] = spawners.pos[i].x;
+        bodies.y[i] = spawners.pos[i].y;
+        bodies.z[i] = spawners.pos[i].z;
+    }
+    ComputeAccelerations(bodies, G, EPSILON, &spawners.nbody, &spawners.acc,
+                         spawners.pool.get());
 
-    spawners.vel[i].y = 0;
-    spawners.particles[i]->Update(dt, spawners.pos, spawners.mass,
-                                  spawners.vel,
-                                  SPAWNER_NUM, i, 0.001, 7);
+    // The pull towards the center is applied once per other spawner
+    const float pull = GRAV * dt * (n - 1);
+    for (GLuint i = 0; i < n; ++i) {
+        vec3 &vel = spawners.vel[i];
+        vel += spawners.acc[i] * dt;
+        vel -= normalize(vec3(spawners.pos[i].x, 2, spawners.pos[i].z)) *
+            pull;
+        ClampV3(&vel);
+        vel.y = 0;
+    }
 }
 
 void UpdateSpawners(const float dt) {
-    for (unsigned int i = 0; i < SPAWNER_NUM; ++i)
-        UpdateSpawner(i, dt);
-    Program::FinishComputes();
+    PROFILE_CPU("UpdateSpawners");
+    if (spawners.gpu) {
+        // Runs with the passes of the pool, which read the spawners. GPU
+        // spawners imply a GPU pool
+        RenderGraph *const graph = spawners.gpu_particles->GetGraph();
+        spawners.gpu->Update(dt, graph);
+        // The CPU copy trails by the frames a readback takes, a new one
+        // is only queued once the last arrived
+        spawners.gpu->PollReadback(spawners.pos.data(), spawners.vel.data());
+        spawners.gpu->RequestReadback(graph);
+    }
+    else
+        MoveSpawners(dt);
+
+    // Scheduled once, so every pool spawns exactly the same particles
+    spawners.budget->Schedule(dt, &spawners.spawn_ends);
+    const GLuint *const spawn_ends = spawners.spawn_ends.data();
+
+    // A single dispatch chain simulates the particles of every spawner
+    spawners.particles->Update(dt, spawners.pos.data(), spawners.mass.data(),
+                               spawners.vel.data(), spawners.num,
+                               spawn_ends, PARTICLE_LIFE);
+    if (spawners.shadow)
+        spawners.shadow->Update(dt, spawners.pos.data(),
+                                spawners.mass.data(), spawners.vel.data(),
+                                spawners.num, spawn_ends, PARTICLE_LIFE);
+    if (spawners.reference) {
+        PROFILE_CPU("reference");
+        spawners.reference->Update(dt, spawners.pos.data(),
+                                   spawners.mass.data(), spawners.vel.data(),
+                                   spawners.num, spawn_ends, PARTICLE_LIFE);
+    }
 }
 
 void DrawSpawners() {
+    PROFILE_CPU("DrawSpawners");
+    // Nothing to bind when the bounds put every cloud off screen
+    if (spawners.gpu_particles &&
+        !spawners.gpu_particles->IsAnyCloudVisible())
+        return;
     particle_tex->Use(0);
-    for (unsigned int i = 0; i < SPAWNER_NUM; ++i) {
-        spawners.particles[i]->Draw();
+    spawners.particles->Draw();
+}
+
+/**
+ * \return number of live particles of every spawner (stalls the GPU)
+ */
+vector<GLuint> CountSpawnerParticles() {
+    return spawners.particles->CountAliveBySpawner(spawners.num);
+}
+
+/**
+ * \return slots the particle pool has allocated so far
+ */
+GLuint GetParticleCapacity() {
+    return spawners.particles->GetCapacity();
+}
+
+/**
+ * \return counter aggregation of the GPU pools, auto with the CPU backend
+ */
+ParticleAtomics GetParticleAtomics() {
+    return spawners.atomics;
+}
+
+/**
+ * \return how UpdateSpawners writes the particles, from shaders on the GPU
+ * or, with the CPU backend, never from a shader, like a transfer
+ */
+GraphAccess GetParticleAccess() {
+    return spawners.gpu_particles ? GRAPH_ACCESS_SSBO :
+        GRAPH_ACCESS_TRANSFER;
+}
+
+/**
+ * \return bounds of every spawner's particles a frame or two ago, empty
+ * with the CPU backend or before the first readback
+ */
+const vector<CloudBounds> &GetSpawnerBounds() {
+    static const vector<CloudBounds> none;
+    return spawners.gpu_particles ?
+        spawners.gpu_particles->GetBounds() : none;
+}
+
+const ParticleBudget &GetParticleBudget() {
+    return *spawners.budget;
+}
+
+/**
+ * \brief Compares two pools slot by slot
+ */
+static ParticleError CompareParticles(const vector<Particle> &a,
+                                      const vector<Particle> &b) {
+    ParticleError err;
+    for (GLuint j = 0; j < a.size() && j < b.size(); ++j) {
+        const float diff[4] = {
+            distance(a[j].pos, b[j].pos),
+            distance(a[j].vel, b[j].vel),
+            abs(a[j].life - b[j].life),
+            abs(a[j].scale - b[j].scale),
+        };
+        for (GLuint k = 0; k < 4; ++k) {
+            err.max[k] = glm::max(err.max[k], diff[k]);
+            err.mean[k] += diff[k];
+        }
     }
+    err.particles = glm::min(a.size(), b.size());
+
+    for (GLuint k = 0; k < 4; ++k)
+        err.mean[k] /= glm::max(err.particles, 1u);
+    return err;
+}
+
+/**
+ * \brief Compares the pool against its float shadow slot by slot. Spawns
+ * get their slots in a deterministic order and a frame's spawns from one
+ * spawner are identical, so slots match up until the first particle dies
+ */
+ParticleError MeasureLayoutError() {
+    if (!spawners.shadow)
+        return {};
+
+    const ParticlePool &pool = *spawners.particles;
+    const ParticleSystem &shadow = *spawners.shadow;
+    const GLuint slots = shadow.CountSlots();
+    ParticleError err = CompareParticles(pool.ReadParticles(slots),
+                                         shadow.ReadParticles(slots));
+    // With the LOD on, the turns of the two may fall on different frames
+    err.lod_near = shadow.GetLODDistance();
+    err.valid = slots == pool.CountSlots() &&
+        slots == shadow.CountAlive() && slots == pool.CountAlive();
+    return err;
+}
+
+/**
+ * \brief Compares the pool against the CPU reference slot by slot, valid
+ * under the same conditions as MeasureLayoutError
+ */
+ParticleError MeasureReferenceError() {
+    if (!spawners.reference)
+        return {};
+
+    const ParticlePool &pool = *spawners.particles;
+    const ParticleReference &reference = *spawners.reference;
+    const GLuint slots = reference.CountSlots();
+    ParticleError err = CompareParticles(pool.ReadParticles(slots),
+                                         reference.ReadParticles(slots));
+    if (spawners.gpu_particles)
+        err.lod_near = spawners.gpu_particles->GetLODDistance();
+    err.valid = slots == pool.CountSlots() &&
+        slots == reference.CountAlive() && slots == pool.CountAlive();
+    return err;
 }
@@ -1,5 +1,78 @@
 #pragma once
-void CreateSpawners();
+#include "renderer.hpp"
+#include "particle_budget.hpp"
+#include <GL/gl.h>
+#include <vector>
+
+struct SpawnerConfig {
+public:
+    // Particle slots of the pool shared by every spawner
+    GLuint particles = 3000000;
+    // Slots the GPU pool starts with and doubles from as needed, 0
+    // allocates all of them up front
+    GLuint initial_particles = 0;
+    // Particles alive at once over all spawners, split between them by
+    // priority and emission rate. 0 only caps the spawns at the pool size
+    GLuint budget = 0;
+    // Budget priority of the first spawners, the rest get 0
+    std::vector<GLuint> priorities;
+    // Spawns per second of the first spawners, 0 pauses one. The rest
+    // spawn at the default rate
+    std::vector<float> rates;
+    GLuint spawners = 3;
+    ParticleLayout layout = PARTICLE_LAYOUT_AOS;
+    ParticleBackend backend = PARTICLE_BACKEND_GPU;
+    ParticleAtomics atomics = PARTICLE_ATOMICS_AUTO;
+    ParticleDraw draw = PARTICLE_DRAW_MESH;
+    // Worker threads of the CPU backend, 0 picks the core count
+    unsigned int threads = 0;
+    // Step the spawners on the GPU, only with the GPU backend and without
+    // the CPU reference, which both need their positions every frame
+    bool gpu_spawners = false;
+    // Frames between Morton reorders of the GPU pool, 0 never reorders.
+    // Moves particles between slots, so not with the shadow or reference
+    GLuint reorder = 0;
+    // Draw from a double buffered snapshot of the visible particles, 32
+    // more bytes per slot, instead of decoding them from the pool
+    bool pipeline = false;
+    // Camera distance from which the GPU pool sums the spawner forces
+    // every 2nd, 4th or 8th frame, 0 every frame. Not with the reference
+    float lod_near = 0;
+    // Draw only the particles inside the view frustum
+    bool culling = true;
+    // Reduce the bounds of every spawner's particles on the GPU, so whole
+    // clouds can be culled on the CPU
+    bool cloud_bounds = true;
+    // Spawn just fast enough to keep every pool full
+    bool saturate = false;
+    // Also simulate a float AoS copy of the pool to measure the error of
+    // the layout against it
+    bool shadow_float = false;
+    // Also run the scalar CPU reference of particle.comp next to the pool
+    bool reference = false;
+};
+
+// INFO: max and mean absolute error of pos, vel, life and scale. Only valid
+// while no particle died, after that slots get recycled in any order
+struct ParticleError {
+public:
+    bool valid = false;
+    GLuint particles = 0;
+    // Temporal LOD distance the measured pool ran with, 0 for none
+    float lod_near = 0;
+    float max[4] = {};
+    float mean[4] = {};
+};
+
+void CreateSpawners(const SpawnerConfig & = {});
 void UpdatePlayer(const float);
 void UpdateSpawners(const float);
 void DrawSpawners();
+std::vector<GLuint> CountSpawnerParticles();
+GLuint GetParticleCapacity();
+ParticleAtomics GetParticleAtomics();
+GraphAccess GetParticleAccess();
+const ParticleBudget &GetParticleBudget();
+const std::vector<CloudBounds> &GetSpawnerBounds();
+ParticleError MeasureLayoutError();
+ParticleError MeasureReferenceError();
@@ -0,0 +1,138 @@
+#include "particle_budget.hpp"
+#include "glm/common.hpp"
+#include <GL/gl.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+using namespace std;
+
+ParticleBudget::ParticleBudget(const GLuint _cap, const GLuint emitters,
+                               const float _spawn_time, const float max_life,
+                               const bool _enforce)
+    : cap(_cap), enforce(_enforce),
+        // A slice is retired when the ring comes back to it, which takes
+        // BUDGET_SLICES - 1 whole slices after its last spawn
+        slice_len(max_life / (BUDGET_SLICES - 1)),
+        priority(emitters, 0), spawn_time(emitters, _spawn_time),
+        last_spawn_time(emitters, 0), quota(emitters, 0),
+        in_flight(emitters, 0), dropped(emitters, 0),
+        slices((size_t)emitters * BUDGET_SLICES, 0) {
+    Allocate();
+}
+
+void ParticleBudget::SetPriority(const GLuint emitter, const GLuint _priority) {
+    priority[emitter] = _priority;
+    Allocate();
+}
+
+/**
+ * \param emitter index of the emitter
+ * \param time seconds between two of its spawns, infinity pauses it
+ */
+void ParticleBudget::SetSpawnTime(const GLuint emitter, const float time) {
+    spawn_time[emitter] = time;
+    Allocate();
+}
+
+/**
+ * \brief Splits the cap into quotas. An emitter never gets more than it
+ * can spawn within the counted window
+ */
+void ParticleBudget::Allocate() {
+    const GLuint n = priority.size();
+    vector<GLuint> order(n);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](GLuint a, GLuint b) {
+        return priority[a] > priority[b];
+    });
+
+    const float window = slice_len * BUDGET_SLICES;
+    double remaining = cap;
+    for (GLuint begin = 0; begin < n;) {
+        GLuint end = begin;
+        double demand = 0;
+        while (end < n && priority[order[end]] == priority[order[begin]])
+            demand += ceil(window / spawn_time[order[end++]]);
+
+        const double share = demand > remaining ? remaining / demand : 1;
+        for (GLuint i = begin; i < end; ++i) {
+            const GLuint e = order[i];
+            quota[e] = floor(ceil(window / spawn_time[e]) * share);
+            remaining -= quota[e];
+        }
+        begin = end;
+    }
+}
+
+/**
+ * \brief Retires the spawns of the slices that got older than a lifetime
+ */
+void ParticleBudget::RetireSlices(const float dt) {
+    slice_time += dt;
+    while (slice_time >= slice_len) {
+        slice_time -= slice_len;
+        slice = (slice + 1) % BUDGET_SLICES;
+        for (GLuint e = 0; e < in_flight.size(); ++e) {
+            GLuint &spawns = slices[(size_t)e * BUDGET_SLICES + slice];
+            in_flight[e] -= spawns;
+            spawns = 0;
+        }
+    }
+}
+
+/**
+ * \brief Advances the spawn timers of every emitter by dt and hands out
+ * this frame's spawns
+ * \param spawn_ends receives the inclusive prefix sum of every emitter's
+ * spawns
+ * \return number of particles to emit this frame, at most the cap
+ */
+GLuint ParticleBudget::Schedule(const float dt, vector<GLuint> *spawn_ends) {
+    RetireSlices(dt);
+    spawn_ends->resize(priority.size());
+
+    GLuint spawn_count = 0;
+    for (GLuint e = 0; e < priority.size(); ++e) {
+        float &last = last_spawn_time[e];
+        GLuint spawns = 0;
+        if (!isinf(spawn_time[e])) {
+            last += dt;
+            spawns = glm::min<float>(floor(last / spawn_time[e]), cap);
+            last = glm::max(last - spawns*spawn_time[e], 0.0f);
+        }
+
+        if (enforce) {
+            const GLuint allowed = quota[e] > in_flight[e] ?
+                quota[e] - in_flight[e] : 0;
+            if (spawns > allowed) {
+                dropped[e] += spawns - allowed;
+                spawns = allowed;
+            }
+        }
+        in_flight[e] += spawns;
+        slices[(size_t)e * BUDGET_SLICES + slice] += spawns;
+        spawn_count += spawns;
+        (*spawn_ends)[e] = spawn_count;
+    }
+    return glm::min(spawn_count, cap);
+}
+
+EmitterUsage ParticleBudget::GetUsage(const GLuint emitter) const {
+    EmitterUsage usage;
+    usage.priority = priority[emitter];
+    usage.quota = quota[emitter];
+    usage.in_flight = in_flight[emitter];
+    usage.dropped = dropped[emitter];
+    return usage;
+}
+
+GLuint ParticleBudget::GetCap() const {
+    return cap;
+}
+
+GLuint ParticleBudget::CountEmitters() const {
+    return priority.size();
+}
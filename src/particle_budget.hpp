@@ -0,0 +1,66 @@
+#pragma once
+#include <GL/gl.h>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Time slices the spawns of every emitter are counted in, the oldest one is
+// retired once a whole lifetime has passed
+#define BUDGET_SLICES 16
+
+struct EmitterUsage {
+public:
+    GLuint priority = 0;
+    // Slots the emitter may hold, only enforced with a budget
+    GLuint quota = 0;
+    // Spawns younger than the longest lifetime, an upper bound of the
+    // emitter's live particles
+    GLuint in_flight = 0;
+    // Spawns refused by the quota so far
+    uint64_t dropped = 0;
+};
+
+/**
+* \brief Schedules the spawns of every emitter under one scene wide cap.
+* Higher priorities are served first, emitters of one priority share what
+* is left in proportion to their emission rate. Spawns are counted until
+* they are older than the longest lifetime, so an emitter never holds more
+* than its quota and nothing has to be read back from the pool
+*/
+class ParticleBudget {
+public:
+    /**
+    * \param cap particles alive at once over all emitters
+    * \param emitters number of emitters
+    * \param spawn_time seconds between two spawns of every emitter
+    * \param max_life longest lifetime of a particle
+    * \param enforce hold every emitter to its quota, else only the spawns
+    * of one frame are capped
+    */
+    ParticleBudget(const GLuint, const GLuint, const float, const float,
+                   const bool);
+    void SetPriority(const GLuint, const GLuint);
+    void SetSpawnTime(const GLuint, const float);
+    GLuint Schedule(const float, vector<GLuint> *);
+    EmitterUsage GetUsage(const GLuint) const;
+    GLuint GetCap() const;
+    GLuint CountEmitters() const;
+private:
+    void Allocate();
+    void RetireSlices(const float);
+private:
+    GLuint cap;
+    bool enforce;
+    float slice_len;
+    float slice_time = 0;
+    GLuint slice = 0;
+    vector<GLuint> priority;
+    vector<float> spawn_time;
+    vector<float> last_spawn_time;
+    vector<GLuint> quota;
+    vector<GLuint> in_flight;
+    vector<uint64_t> dropped;
+    // Spawns of every emitter in each slice, BUDGET_SLICES per emitter
+    vector<GLuint> slices;
+};
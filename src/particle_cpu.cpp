@@ -0,0 +1,345 @@
+#include "particle_cpu.hpp"
+#include "particle_ref.hpp"
+#include "profiler.hpp"
+#include <GL/gl.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARTICLE_CPU_X86
+#endif
+
+// Particles per task, small enough for a chunk's streams to stay in L2
+#define PARTICLE_CPU_CHUNK 8192
+#define PARTICLE_CPU_EMIT_GRAIN 16384
+
+using namespace std;
+
+struct SimParams {
+    const float *spawner_x;
+    const float *spawner_y;
+    const float *spawner_z;
+    const float *spawner_mass;
+    GLuint spawner_num;
+    float dt;
+};
+
+/**
+ * \brief update_particle_vel and clamp_particle_vel of particle.comp on
+ * particles [begin, end) of the streams
+ * \return number of particles still alive
+ */
+static size_t simulate_scalar(ParticleSystemCPU::Streams &s,
+                              const size_t begin, const size_t end,
+                              const SimParams &sp) {
+    size_t alive = 0;
+    for (size_t j = begin; j < end; ++j) {
+        float px = s.pos_x[j] + s.vel_x[j] * sp.dt;
+        float py = s.pos_y[j] + s.vel_y[j] * sp.dt;
+        float pz = s.pos_z[j] + s.vel_z[j] * sp.dt;
+        float vx = s.vel_x[j], vy = s.vel_y[j], vz = s.vel_z[j];
+        const float mass = s.mass[j];
+        const float inv_mass = 1 / std::max(mass, 0.01f);
+        const float grav_cnst = PARTICLE_G * mass;
+
+        for (GLuint i = 0; i < sp.spawner_num; ++i) {
+            const float dx = sp.spawner_x[i] - px;
+            const float dy = sp.spawner_y[i] - py;
+            const float dz = sp.spawner_z[i] - pz;
+            const float dst2 = dx*dx + dy*dy + dz*dz;
+            const float dst = sqrt(dst2);
+            if (dst < 0.01f)
+                continue;
+            const float force = (grav_cnst*sp.spawner_mass[i]) /
+                std::max(dst2 + PARTICLE_EPSILON*PARTICLE_EPSILON, 0.01f);
+            float speed = force * inv_mass * sp.dt / dst;
+            if (i == s.spawner[j])
+                speed = -speed;
+            vx += dx * speed;
+            vy += dy * speed;
+            vz += dz * speed;
+        }
+        vy -= PARTICLE_GRAV * inv_mass * sp.dt;
+
+        const float mag = sqrt(vx*vx + vy*vy + vz*vz);
+        if (mag > PARTICLE_MAX_SPEED) {
+            const float k = PARTICLE_MAX_SPEED / mag;
+            vx *= k;
+            vy *= k;
+            vz *= k;
+        }
+
+        s.pos_x[j] = px;
+        s.pos_y[j] = py;
+        s.pos_z[j] = pz;
+        s.vel_x[j] = vx;
+        s.vel_y[j] = vy;
+        s.vel_z[j] = vz;
+        s.life[j] -= sp.dt;
+        alive += s.life[j] > 0;
+    }
+    return alive;
+}
+
+#ifdef PARTICLE_CPU_X86
+/**
+ * \brief simulate_scalar 8 particles at a time
+ */
+__attribute__((target("avx2,fma")))
+static size_t simulate_avx2(ParticleSystemCPU::Streams &s,
+                            const size_t begin, const size_t end,
+                            const SimParams &sp) {
+    const __m256 dt = _mm256_set1_ps(sp.dt);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 min_dst = _mm256_set1_ps(0.01f);
+    const __m256 eps2 = _mm256_set1_ps(PARTICLE_EPSILON*PARTICLE_EPSILON);
+    const __m256 max_speed = _mm256_set1_ps(PARTICLE_MAX_SPEED);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+
+    size_t alive = 0;
+    size_t j = begin;
+    for (; j + 8 <= end; j += 8) {
+        __m256 vx = _mm256_loadu_ps(&s.vel_x[j]);
+        __m256 vy = _mm256_loadu_ps(&s.vel_y[j]);
+        __m256 vz = _mm256_loadu_ps(&s.vel_z[j]);
+        const __m256 px = _mm256_fmadd_ps(vx, dt, _mm256_loadu_ps(&s.pos_x[j]));
+        const __m256 py = _mm256_fmadd_ps(vy, dt, _mm256_loadu_ps(&s.pos_y[j]));
+        const __m256 pz = _mm256_fmadd_ps(vz, dt, _mm256_loadu_ps(&s.pos_z[j]));
+        const __m256 mass = _mm256_loadu_ps(&s.mass[j]);
+        const __m256 inv_mass_dt = _mm256_div_ps(
+            dt, _mm256_max_ps(mass, min_dst));
+        const __m256 grav_cnst = _mm256_mul_ps(
+            _mm256_set1_ps(PARTICLE_G), mass);
+        const __m256i spawner =
+            _mm256_loadu_si256((const __m256i*)&s.spawner[j]);
+
+        for (GLuint i = 0; i < sp.spawner_num; ++i) {
+            const __m256 dx = _mm256_sub_ps(
+                _mm256_set1_ps(sp.spawner_x[i]), px);
+            const __m256 dy = _mm256_sub_ps(
+                _mm256_set1_ps(sp.spawner_y[i]), py);
+            const __m256 dz = _mm256_sub_ps(
+                _mm256_set1_ps(sp.spawner_z[i]), pz);
+            const __m256 dst2 = _mm256_fmadd_ps(dx, dx,
+                _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+            const __m256 dst = _mm256_sqrt_ps(dst2);
+            const __m256 force = _mm256_div_ps(
+                _mm256_mul_ps(grav_cnst, _mm256_set1_ps(sp.spawner_mass[i])),
+                _mm256_max_ps(_mm256_add_ps(dst2, eps2), min_dst));
+            __m256 speed = _mm256_div_ps(
+                _mm256_mul_ps(force, inv_mass_dt), dst);
+            // Repelled by the own spawner, ignore spawners on top of it
+            const __m256 own = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                spawner, _mm256_set1_epi32(i)));
+            speed = _mm256_xor_ps(speed, _mm256_and_ps(own, sign));
+            speed = _mm256_and_ps(speed,
+                                  _mm256_cmp_ps(dst, min_dst, _CMP_GE_OQ));
+            vx = _mm256_fmadd_ps(dx, speed, vx);
+            vy = _mm256_fmadd_ps(dy, speed, vy);
+            vz = _mm256_fmadd_ps(dz, speed, vz);
+        }
+        vy = _mm256_fnmadd_ps(_mm256_set1_ps(PARTICLE_GRAV), inv_mass_dt, vy);
+
+        const __m256 mag = _mm256_sqrt_ps(_mm256_fmadd_ps(vx, vx,
+            _mm256_fmadd_ps(vy, vy, _mm256_mul_ps(vz, vz))));
+        const __m256 k = _mm256_blendv_ps(
+            _mm256_set1_ps(1), _mm256_div_ps(max_speed, mag),
+            _mm256_cmp_ps(mag, max_speed, _CMP_GT_OQ));
+        vx = _mm256_mul_ps(vx, k);
+        vy = _mm256_mul_ps(vy, k);
+        vz = _mm256_mul_ps(vz, k);
+
+        _mm256_storeu_ps(&s.pos_x[j], px);
+        _mm256_storeu_ps(&s.pos_y[j], py);
+        _mm256_storeu_ps(&s.pos_z[j], pz);
+        _mm256_storeu_ps(&s.vel_x[j], vx);
+        _mm256_storeu_ps(&s.vel_y[j], vy);
+        _mm256_storeu_ps(&s.vel_z[j], vz);
+        const __m256 life = _mm256_sub_ps(_mm256_loadu_ps(&s.life[j]), dt);
+        _mm256_storeu_ps(&s.life[j], life);
+        alive += __builtin_popcount(_mm256_movemask_ps(
+            _mm256_cmp_ps(life, zero, _CMP_GT_OQ)));
+    }
+    return alive + simulate_scalar(s, j, end, sp);
+}
+#endif
+
+static void resize_streams(ParticleSystemCPU::Streams &s, const GLuint n) {
+    for (vector<float> *stream: {&s.pos_x, &s.pos_y, &s.pos_z,
+                                 &s.vel_x, &s.vel_y, &s.vel_z,
+                                 &s.mass, &s.life, &s.scale})
+        stream->resize(n);
+    s.spawner.resize(n);
+}
+
+ParticleSystemCPU::ParticleSystemCPU(const GLuint _max,
+                                     const unsigned int threads)
+    : max(_max), pool(threads) {
+    resize_streams(cur, max);
+    resize_streams(next, max);
+}
+
+bool ParticleSystemCPU::HasAVX2() {
+#ifdef PARTICLE_CPU_X86
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+/**
+ * \brief Appends this frame's spawns after the live particles
+ */
+void ParticleSystemCPU::Emit(const GLuint spawn_count) {
+    const GLuint first = count;
+    pool.ParallelFor(spawn_count, PARTICLE_CPU_EMIT_GRAIN,
+                     [&](const size_t begin, const size_t end) {
+        // Spawner of the first spawn, then walk spawn_ends forward
+        const GLuint spawner_len = spawner_x.size();
+        GLuint spawner = upper_bound(spawn_ends, spawn_ends + spawner_len,
+                                     begin) - spawn_ends;
+        for (size_t i = begin; i < end; ++i) {
+            while (spawner + 1 < spawner_len && i >= spawn_ends[spawner])
+                ++spawner;
+            const Particle p = SpawnParticle(
+                vec3(spawner_x[spawner], spawner_y[spawner],
+                     spawner_z[spawner]), spawner, particle_life);
+            const size_t id = first + i;
+            cur.pos_x[id] = p.pos.x;
+            cur.pos_y[id] = p.pos.y;
+            cur.pos_z[id] = p.pos.z;
+            cur.vel_x[id] = p.vel.x;
+            cur.vel_y[id] = p.vel.y;
+            cur.vel_z[id] = p.vel.z;
+            cur.mass[id] = p.mass;
+            cur.life[id] = p.life;
+            cur.scale[id] = p.scale;
+            cur.spawner[id] = p.spawner;
+        }
+    });
+    count += spawn_count;
+}
+
+/**
+ * \brief Moves the survivors of every chunk into next, in order, and makes
+ * it the live pool
+ */
+void ParticleSystemCPU::Compact() {
+    vector<GLuint> offsets(chunk_alive.size());
+    GLuint alive = 0;
+    for (GLuint c = 0; c < chunk_alive.size(); ++c) {
+        offsets[c] = alive;
+        alive += chunk_alive[c];
+    }
+    if (alive == count)
+        return;
+
+    pool.ParallelFor(count, PARTICLE_CPU_CHUNK,
+                     [&](const size_t begin, const size_t end) {
+        size_t w = offsets[begin / PARTICLE_CPU_CHUNK];
+        for (size_t j = begin; j < end; ++j) {
+            if (cur.life[j] <= 0)
+                continue;
+            next.pos_x[w] = cur.pos_x[j];
+            next.pos_y[w] = cur.pos_y[j];
+            next.pos_z[w] = cur.pos_z[j];
+            next.vel_x[w] = cur.vel_x[j];
+            next.vel_y[w] = cur.vel_y[j];
+            next.vel_z[w] = cur.vel_z[j];
+            next.mass[w] = cur.mass[j];
+            next.life[w] = cur.life[j];
+            next.scale[w] = cur.scale[j];
+            next.spawner[w] = cur.spawner[j];
+            ++w;
+        }
+    });
+    swap(cur, next);
+    count = alive;
+}
+
+void ParticleSystemCPU::Update(const float _dt, const vec3 *pos,
+                               const float *mass, const vec3 *vel,
+                               const GLuint spawner_len,
+                               const GLuint *_spawn_ends,
+                               const float _particle_life) {
+    PROFILE_CPU("cpu_sim");
+    (void)vel;
+    dt = _dt;
+    particle_life = _particle_life;
+    spawner_x.resize(spawner_len);
+    spawner_y.resize(spawner_len);
+    spawner_z.resize(spawner_len);
+    spawner_mass.assign(mass, mass + spawner_len);
+    for (GLuint i = 0; i < spawner_len; ++i) {
+        spawner_x[i] = pos[i].x;
+        spawner_y[i] = pos[i].y;
+        spawner_z[i] = pos[i].z;
+    }
+
+    spawn_ends = _spawn_ends;
+    const GLuint spawn_count = spawner_len ?
+        glm::min(spawn_ends[spawner_len - 1], max) : 0;
+    Emit(glm::min(spawn_count, max - count));
+
+    const SimParams sp = {
+        spawner_x.data(), spawner_y.data(), spawner_z.data(),
+        spawner_mass.data(), spawner_len, dt,
+    };
+    const bool avx2 = HasAVX2();
+    chunk_alive.assign((count + PARTICLE_CPU_CHUNK - 1) / PARTICLE_CPU_CHUNK,
+                       0);
+    pool.ParallelFor(count, PARTICLE_CPU_CHUNK,
+                     [&](const size_t begin, const size_t end) {
+#ifdef PARTICLE_CPU_X86
+        chunk_alive[begin / PARTICLE_CPU_CHUNK] = avx2 ?
+            simulate_avx2(cur, begin, end, sp) :
+            simulate_scalar(cur, begin, end, sp);
+#else
+        (void)avx2;
+        chunk_alive[begin / PARTICLE_CPU_CHUNK] =
+            simulate_scalar(cur, begin, end, sp);
+#endif
+    });
+    Compact();
+}
+
+GLuint ParticleSystemCPU::CountAlive() const {
+    return count;
+}
+
+vector<GLuint> ParticleSystemCPU::CountAliveBySpawner(
+        const GLuint spawner_len) const {
+    vector<GLuint> counts(spawner_len, 0);
+    for (GLuint i = 0; i < count; ++i)
+        if (cur.spawner[i] < spawner_len)
+            ++counts[cur.spawner[i]];
+    return counts;
+}
+
+GLuint ParticleSystemCPU::CountSlots() const {
+    return count;
+}
+
+GLuint ParticleSystemCPU::GetCapacity() const {
+    return max;
+}
+
+vector<Particle> ParticleSystemCPU::ReadParticles(GLuint n) const {
+    n = glm::min(n, count);
+    vector<Particle> particles(n);
+    for (GLuint i = 0; i < n; ++i) {
+        particles[i].pos = vec3(cur.pos_x[i], cur.pos_y[i], cur.pos_z[i]);
+        particles[i].vel = vec3(cur.vel_x[i], cur.vel_y[i], cur.vel_z[i]);
+        particles[i].mass = cur.mass[i];
+        particles[i].life = cur.life[i];
+        particles[i].scale = cur.scale[i];
+        particles[i].spawner = cur.spawner[i];
+    }
+    return particles;
+}
+
+unsigned int ParticleSystemCPU::GetThreads() const {
+    return pool.GetThreads();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "renderer.hpp"
+#include "thread_pool.hpp"
+#include <GL/gl.h>
+#include <vector>
+
+using namespace std;
+
+/**
+* \brief Particle backend that runs particle.comp's simulation on the CPU,
+* for nodes without a usable GPU. Particles are kept dense in SoA streams,
+* so the integrator runs over contiguous memory with AVX2 when the CPU has
+* it, split into chunks across a work-stealing pool
+*/
+class ParticleSystemCPU : public ParticlePool {
+public:
+    /**
+    * \param max pool size
+    * \param threads worker threads, 0 picks the core count
+    */
+    ParticleSystemCPU(const GLuint, const unsigned int = 0);
+    void Update(const float, const vec3 *, const float *, const vec3 *,
+                const GLuint, const GLuint *, const float) override;
+    GLuint CountAlive() const override;
+    vector<GLuint> CountAliveBySpawner(const GLuint) const override;
+    GLuint CountSlots() const override;
+    GLuint GetCapacity() const override;
+    vector<Particle> ReadParticles(GLuint) const override;
+    unsigned int GetThreads() const;
+    /**
+    * \return true if the integrator runs the AVX2 path
+    */
+    static bool HasAVX2();
+public:
+    struct Streams {
+        vector<float> pos_x, pos_y, pos_z;
+        vector<float> vel_x, vel_y, vel_z;
+        vector<float> mass, life, scale;
+        vector<GLuint> spawner;
+    };
+private:
+    void Emit(const GLuint);
+    void Compact();
+private:
+    GLuint max;
+    GLuint count = 0;
+    // Live particles are [0, count) of cur, next receives the survivors
+    Streams cur;
+    Streams next;
+    vector<GLuint> chunk_alive;
+    // Frame inputs, the CPU side of FrameBuf
+    const GLuint *spawn_ends = nullptr;
+    vector<float> spawner_x, spawner_y, spawner_z, spawner_mass;
+    float dt = 0;
+    float particle_life = 0;
+    ThreadPool pool;
+};
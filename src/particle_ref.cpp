@@ -0,0 +1,167 @@
+#include "particle_ref.hpp"
+#include "glm/common.hpp"
+#include "glm/ext/vector_float3.hpp"
+#include "glm/geometric.hpp"
+#include <GL/gl.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace glm;
+using namespace std;
+
+static float random(float seed) {
+    seed = fract(seed * 0.1031f);
+    seed *= seed + 33.33f;
+    seed *= seed + seed;
+    return (fract(seed)*2)-1;
+}
+
+static float random_range(const float seed, const float min,
+                          const float max) {
+    return random(seed) * (max-min) + min;
+}
+
+static void update_particle_vel(Particle &p, const vec3 *spawner_pos,
+                                const float *spawner_mass,
+                                const GLuint spawner_num, const float dt) {
+    const float grav_cnst = PARTICLE_G * p.mass;
+    for (GLuint i = 0; i < spawner_num; ++i) {
+        const float dst = distance(p.pos, spawner_pos[i]);
+        if (dst < 0.01f)
+            continue;
+
+        const float force = (grav_cnst*spawner_mass[i])/
+            glm::max(pow(dst, 2.0f) + pow((float)PARTICLE_EPSILON, 2.0f), 0.01f);
+        const vec3 dir = normalize(spawner_pos[i]-p.pos);
+        float speed = (force/glm::max(p.mass, 0.01f))*dt;
+        if (i == p.spawner)
+            speed *= -1;
+        p.vel += dir * speed;
+    }
+
+    p.vel.y -= (PARTICLE_GRAV/glm::max(p.mass, 0.01f)) * dt;
+}
+
+static void clamp_particle_vel(Particle &p) {
+    float mag = length(p.vel);
+    if (mag > PARTICLE_MAX_SPEED) {
+        const vec3 dir = normalize(p.vel);
+        mag = glm::min<float>(PARTICLE_MAX_SPEED, mag);
+        p.vel = dir * mag;
+    }
+}
+
+Particle SpawnParticle(const vec3 &spawner_pos, const GLuint spawner,
+                       const float particle_life) {
+    Particle p = {};
+    p.spawner = spawner;
+    p.pos = spawner_pos;
+    p.vel = vec3(
+                random(p.pos.x*p.pos.y),
+                random(p.pos.y*p.pos.z),
+                random(p.pos.x*p.pos.z)
+            ) * (float)PARTICLE_SPREAD;
+    p.mass = 40;
+    p.scale = random_range(p.vel.x*p.vel.y, 1, 1.25);
+    p.life = particle_life + random(p.pos.y*-p.pos.z);
+    return p;
+}
+
+ParticleReference::ParticleReference(const GLuint _max)
+    : max(_max), particles(_max), free_list(_max) {
+    alive.reserve(max);
+    alive_next.reserve(max);
+}
+
+/**
+ * \brief Emits spawn i the way init_particle does, with the counters of
+ * the previous frame
+ */
+void ParticleReference::InitParticle(const GLuint i, const GLuint spawner) {
+    GLuint id;
+    if (i < free_count)
+        id = free_list[free_count - 1 - i];
+    else {
+        id = slot_count + i - free_count;
+        if (id >= max)
+            return;
+    }
+
+    particles[id] = SpawnParticle(spawner_pos[spawner], spawner,
+                                  particle_life);
+    alive.push_back(id);
+}
+
+void ParticleReference::Simulate(const GLuint id) {
+    Particle &p = particles[id];
+    p.pos += p.vel * dt;
+    update_particle_vel(p, spawner_pos, spawner_mass, spawner_num, dt);
+    clamp_particle_vel(p);
+    p.life -= dt;
+    if (p.life <= 0)
+        free_list[free_count++] = id;
+    else
+        alive_next.push_back(id);
+}
+
+void ParticleReference::Update(const float _dt, const vec3 *pos,
+                               const float *mass, const vec3 *vel,
+                               const GLuint spawner_len,
+                               const GLuint *spawn_ends,
+                               const float _particle_life) {
+    (void)vel;
+    spawner_pos = pos;
+    spawner_mass = mass;
+    spawner_num = spawner_len;
+    dt = _dt;
+    particle_life = _particle_life;
+
+    const GLuint spawn_count = spawner_len ?
+        glm::min(spawn_ends[spawner_len - 1], max) : 0;
+
+    // Emit, spawn_ends is sorted so the spawner only moves forward
+    GLuint spawner = 0;
+    for (GLuint i = 0; i < spawn_count; ++i) {
+        while (spawner + 1 < spawner_num && i >= spawn_ends[spawner])
+            ++spawner;
+        InitParticle(i, spawner);
+    }
+
+    // Commit the counters like write_args
+    const GLuint from_free = glm::min(spawn_count, free_count);
+    free_count -= from_free;
+    slot_count = glm::min(slot_count + spawn_count - from_free, max);
+
+    // Simulate, survivors make up the next alive list
+    alive_next.clear();
+    for (const GLuint id: alive)
+        Simulate(id);
+    swap(alive, alive_next);
+}
+
+GLuint ParticleReference::CountAlive() const {
+    return alive.size();
+}
+
+GLuint ParticleReference::CountSlots() const {
+    return slot_count;
+}
+
+GLuint ParticleReference::GetCapacity() const {
+    return max;
+}
+
+vector<GLuint> ParticleReference::CountAliveBySpawner(
+        const GLuint spawner_len) const {
+    vector<GLuint> counts(spawner_len, 0);
+    for (const GLuint id: alive)
+        if (particles[id].spawner < spawner_len)
+            ++counts[particles[id].spawner];
+    return counts;
+}
+
+vector<Particle> ParticleReference::ReadParticles(GLuint count) const {
+    count = glm::min(count, max);
+    return vector<Particle>(particles.begin(), particles.begin() + count);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "renderer.hpp"
+#include <GL/gl.h>
+#include <vector>
+
+// INFO: keep in sync with the defines of particle.comp
+#define PARTICLE_G 3000
+#define PARTICLE_GRAV 667
+#define PARTICLE_EPSILON 10
+#define PARTICLE_MAX_SPEED 4
+#define PARTICLE_SPREAD 10
+
+using namespace std;
+
+/**
+* \brief New particle of a spawner exactly like init_particle makes it
+*/
+Particle SpawnParticle(const vec3 &, const GLuint, const float);
+
+/**
+* \brief Scalar CPU port of particle.comp. Mirrors its spawn rules, free
+* stack, alive lists and integrator step by step, so it serves as ground
+* truth for the GPU pool and as the baseline of CPU throughput
+*/
+class ParticleReference : public ParticlePool {
+public:
+    ParticleReference(const GLuint);
+    void Update(const float, const vec3 *, const float *, const vec3 *,
+                const GLuint, const GLuint *, const float) override;
+    GLuint CountAlive() const override;
+    vector<GLuint> CountAliveBySpawner(const GLuint) const override;
+    GLuint CountSlots() const override;
+    GLuint GetCapacity() const override;
+    vector<Particle> ReadParticles(GLuint) const override;
+private:
+    void InitParticle(const GLuint, const GLuint);
+    void Simulate(const GLuint);
+private:
+    GLuint max;
+    vector<Particle> particles;
+    vector<GLuint> free_list;
+    GLuint free_count = 0;
+    GLuint slot_count = 0;
+    vector<GLuint> alive;
+    vector<GLuint> alive_next;
+    // Frame inputs, the CPU side of FrameBuf
+    const vec3 *spawner_pos = nullptr;
+    const float *spawner_mass = nullptr;
+    GLuint spawner_num = 0;
+    float dt = 0;
+    float particle_life = 0;
+};
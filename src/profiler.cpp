@@ -0,0 +1,214 @@
+#include "profiler.hpp"
+#include "gl_func.hpp"
+#include "logger.hpp"
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <print>
+#include <vector>
+
+using namespace std;
+
+struct PendingZone {
+    const char *name;
+    GLuint begin;
+    GLuint end;
+};
+
+// Timestamp queries of one frame in flight
+struct FrameQueries {
+    vector<GLuint> queries;
+    GLuint used = 0;
+    vector<PendingZone> zones;
+    GLuint frame = 0;
+};
+
+static bool enabled = false;
+// Wait on late frames instead of dropping them
+static bool lossless = false;
+static GLuint frame = 0;
+static chrono::steady_clock::time_point cpu_origin;
+static GLint64 gpu_origin = 0;
+static FrameQueries in_flight[PROFILER_LATENCY];
+static vector<ProfileEvent> events;
+static GLuint events_head = 0;
+static GLuint events_len = 0;
+static GLuint dropped = 0;
+static function<void(const ProfileEvent &)> sink;
+
+static void record(const ProfileEvent &event) {
+    events[events_head] = event;
+    events_head = (events_head + 1) % events.size();
+    if (events_len < events.size())
+        ++events_len;
+    if (sink)
+        sink(event);
+}
+
+static FrameQueries &current_frame() {
+    return in_flight[frame % PROFILER_LATENCY];
+}
+
+/**
+ * \brief Turns the timestamps of a past frame into events
+ * \param wait block until the GPU is done instead of dropping the frame
+ */
+static void resolve(FrameQueries &fq, const bool wait) {
+    if (fq.zones.empty())
+        return;
+    if (!wait && !lossless) {
+        // Queries complete in order, the last one covers the frame
+        GLuint64 available = 0;
+        glGetQueryObjectui64v(fq.queries[fq.used - 1],
+                              GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            dropped += fq.zones.size();
+            fq.zones.clear();
+            fq.used = 0;
+            return;
+        }
+    }
+
+    for (const PendingZone &zone: fq.zones) {
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(fq.queries[zone.begin], GL_QUERY_RESULT,
+                              &begin);
+        glGetQueryObjectui64v(fq.queries[zone.end], GL_QUERY_RESULT, &end);
+        const GLint64 start = (GLint64)begin - gpu_origin;
+        record({zone.name, start > 0 ? (uint64_t)start : 0,
+                end > begin ? end - begin : 0, fq.frame, true});
+    }
+    fq.zones.clear();
+    fq.used = 0;
+}
+
+static uint64_t cpu_ns(const chrono::steady_clock::time_point t) {
+    return chrono::duration_cast<chrono::nanoseconds>(t - cpu_origin)
+        .count();
+}
+
+void ProfilerInit(const bool _enabled, const bool _lossless,
+                  const GLuint capacity) {
+    enabled = _enabled;
+    lossless = _lossless;
+    if (!enabled)
+        return;
+    events.resize(capacity);
+    // Both clocks start at the same instant, GPU zones line up with the
+    // CPU ones up to the drift over the run
+    glGetInteger64v(GL_TIMESTAMP, &gpu_origin);
+    cpu_origin = chrono::steady_clock::now();
+}
+
+void ProfilerShutdown() {
+    if (!enabled)
+        return;
+    for (FrameQueries &fq: in_flight) {
+        if (!fq.queries.empty())
+            glDeleteQueries(fq.queries.size(), fq.queries.data());
+        fq = FrameQueries();
+    }
+    if (dropped)
+        INF("Profiler dropped {} GPU zones that were not ready in time",
+            dropped);
+    enabled = false;
+}
+
+bool ProfilerIsEnabled() {
+    return enabled;
+}
+
+GLuint ProfilerGetFrame() {
+    return frame;
+}
+
+void ProfilerBeginFrame() {
+    if (!enabled)
+        return;
+    ++frame;
+    FrameQueries &fq = current_frame();
+    resolve(fq, false);
+    fq.frame = frame;
+}
+
+void ProfilerFlush() {
+    if (!enabled)
+        return;
+    // Oldest first so the events stay in order
+    for (GLuint i = 1; i <= PROFILER_LATENCY; ++i)
+        resolve(in_flight[(frame + i) % PROFILER_LATENCY], true);
+}
+
+void ProfilerSetSink(function<void(const ProfileEvent &)> _sink) {
+    sink = _sink;
+}
+
+int ProfilerDump(const char *const path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        THROW(1, "Cannot open '{}' for the trace", path);
+
+    println(f, "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    println(f, "  {{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            "\"tid\": 0, \"args\": {{\"name\": \"CPU\"}}}},");
+    print(f, "  {{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+          "\"tid\": 1, \"args\": {{\"name\": \"GPU\"}}}}");
+    const GLuint first = events_len ?
+        (events_head + events.size() - events_len) % events.size() : 0;
+    for (GLuint i = 0; i < events_len; ++i) {
+        const ProfileEvent &e = events[(first + i) % events.size()];
+        print(f, ",\n  {{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"X\", "
+              "\"pid\": 0, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}, "
+              "\"args\": {{\"frame\": {}}}}}",
+              e.name, e.gpu ? "gpu" : "cpu", e.gpu ? 1 : 0,
+              e.start_ns / 1e3, e.dur_ns / 1e3, e.frame);
+    }
+    println(f, "\n]}}");
+    fclose(f);
+    INF("Wrote {} profiler events to '{}'", events_len, path);
+    return 0;
+}
+
+CpuZone::CpuZone(const char *const _name) : name(_name) {
+    if (enabled)
+        start = chrono::steady_clock::now();
+}
+
+CpuZone::~CpuZone() {
+    if (!enabled)
+        return;
+    const auto end = chrono::steady_clock::now();
+    record({name, cpu_ns(start), cpu_ns(end) - cpu_ns(start), frame, false});
+}
+
+/**
+ * \return a free timestamp query of the current frame
+ */
+static GLuint next_query() {
+    FrameQueries &fq = current_frame();
+    if (fq.used == fq.queries.size()) {
+        const GLuint old = fq.queries.size();
+        fq.queries.resize(old ? old * 2 : 16);
+        glGenQueries(fq.queries.size() - old, fq.queries.data() + old);
+    }
+    return fq.used++;
+}
+
+GpuZone::GpuZone(const char *const _name) : name(_name) {
+    if (!enabled)
+        return;
+    begin = next_query();
+    glQueryCounter(current_frame().queries[begin], GL_TIMESTAMP);
+}
+
+GpuZone::~GpuZone() {
+    if (!enabled)
+        return;
+    const GLuint end = next_query();
+    FrameQueries &fq = current_frame();
+    glQueryCounter(fq.queries[end], GL_TIMESTAMP);
+    fq.zones.push_back({name, begin, end});
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <GL/gl.h>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+using namespace std;
+
+// Frames a GPU zone is left in flight before its timestamps are read
+#define PROFILER_LATENCY 4
+
+struct ProfileEvent {
+    // Zone names are string literals, only the pointer is kept
+    const char *name;
+    // Nanoseconds since ProfilerInit on the CPU clock, GPU zones included
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    GLuint frame;
+    bool gpu;
+};
+
+/**
+* \brief Sets the profiler up, zones cost a branch when it is disabled
+* \param enabled record zones
+* \param lossless wait on GPU zones still running PROFILER_LATENCY frames
+* later instead of dropping them. Slow frames are the late ones, so
+* measurements need it
+* \param capacity events kept in the ring, older ones are overwritten
+*/
+void ProfilerInit(const bool, const bool = false, const GLuint = 1 << 16);
+void ProfilerShutdown();
+bool ProfilerIsEnabled();
+GLuint ProfilerGetFrame();
+/**
+* \brief Starts a frame and resolves the GPU zones of PROFILER_LATENCY
+* frames ago, only waiting on the GPU when lossless
+*/
+void ProfilerBeginFrame();
+/**
+* \brief Waits for every GPU zone in flight and resolves it
+*/
+void ProfilerFlush();
+/**
+* \brief Calls sink with every event as it is recorded or resolved
+*/
+void ProfilerSetSink(function<void(const ProfileEvent &)>);
+/**
+* \brief Writes the events in the ring as Chrome trace_event JSON
+* \return zero if the trace was written
+*/
+int ProfilerDump(const char *const);
+
+class CpuZone {
+public:
+    CpuZone(const char *const);
+    CpuZone(const CpuZone &) = delete;
+    ~CpuZone();
+private:
+    const char *name;
+    chrono::steady_clock::time_point start;
+};
+
+/**
+* \brief Brackets the GL commands issued in its scope with GL_TIMESTAMP
+* queries, zones may nest
+*/
+class GpuZone {
+public:
+    GpuZone(const char *const);
+    GpuZone(const GpuZone &) = delete;
+    ~GpuZone();
+private:
+    const char *name;
+    GLuint begin;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_CPU(name) CpuZone PROFILE_CONCAT(cpu_zone_, __LINE__)(name)
+#define PROFILE_GPU(name) GpuZone PROFILE_CONCAT(gpu_zone_, __LINE__)(name)
@@ -0,0 +1,337 @@
+#include "render_graph.hpp"
+#include "gl_func.hpp"
+#include "logger.hpp"
+#include "profiler.hpp"
+#include "renderer.hpp"
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// A shared clock orders shader writes and barriers of every graph, since a
+// glMemoryBarrier covers all resources whoever issued it
+static uint64_t barrier_clock = 0;
+static uint64_t barrier_issued[32] = {};
+
+void RecordBarrier(const GLbitfield bits) {
+    ++barrier_clock;
+    for (GLuint b = 0; b < 32; ++b)
+        if (bits & (1u << b))
+            barrier_issued[b] = barrier_clock;
+}
+
+GraphUse GraphRead(const GLuint resource, const GraphAccess access) {
+    return {resource, access, false};
+}
+
+GraphUse GraphWrite(const GLuint resource, const GraphAccess access) {
+    return {resource, access, true};
+}
+
+/**
+ * \return the barrier bit that makes shader writes visible to the access
+ */
+static GLbitfield access_barrier(const GraphAccess access,
+                                 const GraphResourceType type) {
+    switch (access) {
+        case GRAPH_ACCESS_SSBO:
+            return GL_SHADER_STORAGE_BARRIER_BIT;
+        case GRAPH_ACCESS_IMAGE:
+            return GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+        case GRAPH_ACCESS_SAMPLE:
+            return GL_TEXTURE_FETCH_BARRIER_BIT;
+        case GRAPH_ACCESS_INDIRECT:
+            return GL_COMMAND_BARRIER_BIT;
+        case GRAPH_ACCESS_VERTEX:
+            return GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT;
+        case GRAPH_ACCESS_TRANSFER:
+            return type == GRAPH_RESOURCE_TEXTURE ?
+                GL_TEXTURE_UPDATE_BARRIER_BIT : GL_BUFFER_UPDATE_BARRIER_BIT;
+        default:
+            return GL_ALL_BARRIER_BITS;
+    }
+}
+
+static bool is_shader_write(const GraphUse &use) {
+    return use.write && (use.access == GRAPH_ACCESS_SSBO ||
+                         use.access == GRAPH_ACCESS_IMAGE);
+}
+
+RenderGraph::~RenderGraph() {
+    for (const PoolEntry &entry: pool) {
+        if (entry.type == GRAPH_RESOURCE_TEXTURE)
+            glDeleteTextures(1, &entry.handle);
+        else
+            glDeleteBuffers(1, &entry.handle);
+    }
+}
+
+RenderGraph::Resource &RenderGraph::Get(const GLuint id) {
+    return id & GRAPH_TRANSIENT_BIT ?
+        transients[id & ~GRAPH_TRANSIENT_BIT] : resources[id];
+}
+
+const RenderGraph::Resource &RenderGraph::Get(const GLuint id) const {
+    return id & GRAPH_TRANSIENT_BIT ?
+        transients[id & ~GRAPH_TRANSIENT_BIT] : resources[id];
+}
+
+/**
+ * \return position of a resource among the imports, then the transients
+ */
+GLuint RenderGraph::Index(const GLuint id) const {
+    return id & GRAPH_TRANSIENT_BIT ?
+        resources.size() + (id & ~GRAPH_TRANSIENT_BIT) : id;
+}
+
+/**
+ * \brief Declares a resource the caller owns. The same name gives the same
+ * resource in every frame, so its pending writes carry over
+ * \return id of the resource for the passes, the same for every Import of
+ * the name, so callers may keep it across Execute
+ */
+GLuint RenderGraph::Import(const string &name, const GraphResourceType type) {
+    const auto found = imports.find(name);
+    if (found != imports.end())
+        return found->second;
+    Resource resource;
+    resource.name = name;
+    resource.type = type;
+    resource.transient = false;
+    resources.push_back(std::move(resource));
+    imports[name] = resources.size() - 1;
+    return resources.size() - 1;
+}
+
+/**
+ * \brief Declares a buffer that only lives during this Execute
+ * \param size bytes, a pooled buffer may be larger
+ */
+GLuint RenderGraph::CreateBuffer(const string &name, const GLsizeiptr size) {
+    Resource resource;
+    resource.name = name;
+    resource.type = GRAPH_RESOURCE_BUFFER;
+    resource.transient = true;
+    resource.size = size;
+    transients.push_back(std::move(resource));
+    return (transients.size() - 1) | GRAPH_TRANSIENT_BIT;
+}
+
+/**
+ * \brief Declares a texture with a single level that only lives during
+ * this Execute
+ */
+GLuint RenderGraph::CreateTexture(const string &name, const GLsizei width,
+                                  const GLsizei height, const GLenum format) {
+    Resource resource;
+    resource.name = name;
+    resource.type = GRAPH_RESOURCE_TEXTURE;
+    resource.transient = true;
+    resource.width = width;
+    resource.height = height;
+    resource.format = format;
+    transients.push_back(std::move(resource));
+    return (transients.size() - 1) | GRAPH_TRANSIENT_BIT;
+}
+
+/**
+ * \param uses every resource the pass reads or writes and how
+ * \param run issues the GL work, transients are valid inside it
+ */
+void RenderGraph::AddPass(const string &name, const vector<GraphUse> &uses,
+                          function<void()> run) {
+    passes.push_back({name, uses, std::move(run)});
+}
+
+/**
+ * \return GL name of a transient, only valid inside the passes using it
+ */
+GLuint RenderGraph::GetHandle(const GLuint resource) const {
+    return Get(resource).handle;
+}
+
+/**
+ * \return the bits of every access of the pass to data a shader wrote
+ * after the last barrier of that bit
+ */
+GLbitfield RenderGraph::NeededBarrier(const Pass &pass) const {
+    GLbitfield bits = 0;
+    for (const GraphUse &use: pass.uses) {
+        const Resource &resource = Get(use.resource);
+        if (!resource.written)
+            continue;
+        const GLbitfield bit = access_barrier(use.access, resource.type);
+        if (resource.written > barrier_issued[countr_zero(bit)])
+            bits |= bit;
+    }
+    return bits;
+}
+
+/**
+ * \brief Gives a transient a free pool entry that fits, or a new one. It
+ * inherits the entry's pending writes
+ */
+void RenderGraph::Acquire(Resource *resource) {
+    for (GLuint i = 0; i < pool.size(); ++i) {
+        PoolEntry &entry = pool[i];
+        if (entry.used || entry.type != resource->type)
+            continue;
+        const bool fits = resource->type == GRAPH_RESOURCE_BUFFER ?
+            entry.size >= resource->size :
+            entry.width == resource->width &&
+            entry.height == resource->height &&
+            entry.format == resource->format;
+        if (!fits)
+            continue;
+        entry.used = true;
+        entry.last_execute = executes;
+        resource->handle = entry.handle;
+        resource->written = entry.written;
+        resource->pool_entry = i;
+        return;
+    }
+
+    PoolEntry entry = {resource->type, 0, resource->size, resource->width,
+                       resource->height, resource->format, 0, executes,
+                       true};
+    if (resource->type == GRAPH_RESOURCE_TEXTURE) {
+        glGenTextures(1, &entry.handle);
+        glBindTexture(GL_TEXTURE_2D, entry.handle);
+        glTexStorage2D(GL_TEXTURE_2D, 1, entry.format, entry.width,
+                       entry.height);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    } else {
+        glGenBuffers(1, &entry.handle);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, entry.handle);
+        glBufferData(GL_COPY_WRITE_BUFFER, entry.size, nullptr,
+                     GL_DYNAMIC_COPY);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    resource->handle = entry.handle;
+    resource->written = 0;
+    resource->pool_entry = pool.size();
+    pool.push_back(entry);
+}
+
+void RenderGraph::Release(Resource *resource) {
+    PoolEntry &entry = pool[resource->pool_entry];
+    entry.used = false;
+    entry.written = resource->written;
+    resource->handle = 0;
+}
+
+/**
+ * \brief Frees the pool entries no recent Execute used
+ */
+void RenderGraph::TrimPool() {
+    for (GLuint i = 0; i < pool.size();) {
+        if (executes - pool[i].last_execute <= GRAPH_POOL_FRAMES) {
+            ++i;
+            continue;
+        }
+        if (pool[i].type == GRAPH_RESOURCE_TEXTURE)
+            glDeleteTextures(1, &pool[i].handle);
+        else
+            glDeleteBuffers(1, &pool[i].handle);
+        pool[i] = pool.back();
+        pool.pop_back();
+    }
+}
+
+/**
+ * \brief Runs every pass once its dependencies ran, with the barrier it
+ * needs right before it. A reader depends on the last writer of each of
+ * its resources, a writer also on the readers since then. Clears the
+ * passes and transients afterwards
+ */
+void RenderGraph::Execute() {
+    PROFILE_CPU("RenderGraph");
+    ++executes;
+
+    const GLuint n = passes.size();
+    vector<vector<GLuint>> next(n);
+    vector<GLuint> waits(n, 0);
+    const GLuint resource_num = resources.size() + transients.size();
+    vector<GLint> last_writer(resource_num, -1);
+    vector<vector<GLuint>> readers(resource_num);
+    for (GLuint p = 0; p < n; ++p) {
+        for (const GraphUse &use: passes[p].uses) {
+            const GLuint r = Index(use.resource);
+            ++Get(use.resource).uses_left;
+            vector<GLuint> deps;
+            if (last_writer[r] >= 0 && (GLuint)last_writer[r] != p)
+                deps.push_back(last_writer[r]);
+            if (use.write) {
+                for (const GLuint reader: readers[r])
+                    if (reader != p)
+                        deps.push_back(reader);
+                readers[r].clear();
+                last_writer[r] = p;
+            } else
+                readers[r].push_back(p);
+            for (const GLuint dep: deps) {
+                next[dep].push_back(p);
+                ++waits[p];
+            }
+        }
+    }
+
+    vector<GLuint> ready;
+    for (GLuint p = 0; p < n; ++p)
+        if (!waits[p])
+            ready.push_back(p);
+    GLuint done = 0;
+    while (!ready.empty()) {
+        // The first pass in declaration order that needs no barrier, else
+        // the first one
+        GLuint pick = 0;
+        bool pick_free = !NeededBarrier(passes[ready[0]]);
+        for (GLuint i = 1; i < ready.size(); ++i) {
+            const bool free = !NeededBarrier(passes[ready[i]]);
+            if ((free && !pick_free) ||
+                (free == pick_free && ready[i] < ready[pick])) {
+                pick = i;
+                pick_free = free;
+            }
+        }
+        const GLuint p = ready[pick];
+        ready.erase(ready.begin() + pick);
+        Pass &pass = passes[p];
+
+        for (const GraphUse &use: pass.uses) {
+            Resource &resource = Get(use.resource);
+            if (resource.transient && !resource.handle)
+                Acquire(&resource);
+        }
+        const GLbitfield bits = NeededBarrier(pass);
+        if (bits)
+            Program::FinishComputes(bits);
+        pass.run();
+        for (const GraphUse &use: pass.uses) {
+            Resource &resource = Get(use.resource);
+            if (is_shader_write(use))
+                resource.written = ++barrier_clock;
+            if (!--resource.uses_left && resource.transient)
+                Release(&resource);
+        }
+        ++done;
+        for (const GLuint dep: next[p])
+            if (!--waits[dep])
+                ready.push_back(dep);
+    }
+    if (done != n)
+        ERR("Render graph ran {} of {} passes", done, n);
+
+    // Only imports outlive the frame
+    for (Resource &resource: resources)
+        resource.uses_left = 0;
+    transients.clear();
+    passes.clear();
+    TrimPool();
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <GL/gl.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Executions a pooled transient may sit unused before it is freed
+#define GRAPH_POOL_FRAMES 240
+// Set in the ids of transients, imports keep theirs for the whole graph
+#define GRAPH_TRANSIENT_BIT (1u << 31)
+
+// INFO: how a pass touches a resource. Shader writes (SSBO and image
+// stores) need a barrier of the reader's kind before anything else touches
+// the data. Everything else is ordered by GL itself
+enum GraphAccess {
+    GRAPH_ACCESS_SSBO,
+    GRAPH_ACCESS_IMAGE,
+    GRAPH_ACCESS_SAMPLE,
+    GRAPH_ACCESS_INDIRECT,
+    GRAPH_ACCESS_VERTEX,
+    // Copies, clears, readbacks and mipmap generation
+    GRAPH_ACCESS_TRANSFER,
+    GRAPH_ACCESS_NUM
+};
+
+enum GraphResourceType {
+    GRAPH_RESOURCE_BUFFER,
+    GRAPH_RESOURCE_TEXTURE,
+    GRAPH_RESOURCE_NUM
+};
+
+struct GraphUse {
+public:
+    GLuint resource;
+    GraphAccess access;
+    bool write;
+};
+
+GraphUse GraphRead(const GLuint, const GraphAccess);
+GraphUse GraphWrite(const GLuint, const GraphAccess);
+
+/**
+* \brief Notes a glMemoryBarrier, every graph skips the bits issued since
+* the writes it waits for. Program::FinishComputes calls it
+*/
+void RecordBarrier(const GLbitfield);
+
+/**
+* \brief Frame graph of GL passes. Passes declare the resources they read
+* and write, Execute orders them by those dependencies and issues only the
+* barrier bits the next pass needs. Among the passes that are free to run
+* it prefers those that need no barrier, so work that doesn't depend on a
+* shader write is submitted before the barrier. Transient buffers and
+* textures are taken from a pool when first used and handed back after
+* their last pass, so later passes and frames reuse them.
+* Passes and transients last for one Execute, imported resources, their
+* ids and the state of their writes for the lifetime of the graph
+*/
+class RenderGraph {
+public:
+    RenderGraph() = default;
+    RenderGraph(const RenderGraph &) = delete;
+    ~RenderGraph();
+    GLuint Import(const string &, const GraphResourceType);
+    GLuint CreateBuffer(const string &, const GLsizeiptr);
+    GLuint CreateTexture(const string &, const GLsizei, const GLsizei,
+                         const GLenum);
+    void AddPass(const string &, const vector<GraphUse> &,
+                 function<void()>);
+    GLuint GetHandle(const GLuint) const;
+    void Execute();
+private:
+    struct Resource {
+    public:
+        string name;
+        GraphResourceType type;
+        bool transient;
+        GLsizeiptr size = 0;
+        GLsizei width = 0;
+        GLsizei height = 0;
+        GLenum format = 0;
+        // Barrier clock of the last shader write, 0 without any
+        uint64_t written = 0;
+        // GL name of a transient while it holds a pool entry
+        GLuint handle = 0;
+        GLuint pool_entry = 0;
+        GLuint uses_left = 0;
+    };
+    struct Pass {
+    public:
+        string name;
+        vector<GraphUse> uses;
+        function<void()> run;
+    };
+    struct PoolEntry {
+    public:
+        GraphResourceType type;
+        GLuint handle;
+        GLsizeiptr size;
+        GLsizei width;
+        GLsizei height;
+        GLenum format;
+        uint64_t written;
+        uint64_t last_execute;
+        bool used;
+    };
+private:
+    Resource &Get(const GLuint);
+    const Resource &Get(const GLuint) const;
+    GLuint Index(const GLuint) const;
+    GLbitfield NeededBarrier(const Pass &) const;
+    void Acquire(Resource *);
+    void Release(Resource *);
+    void TrimPool();
+private:
+    vector<Resource> resources;
+    vector<Resource> transients;
+    unordered_map<string, GLuint> imports;
+    vector<Pass> passes;
+    vector<PoolEntry> pool;
+    uint64_t executes = 0;
+};
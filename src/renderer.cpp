@@ -3,34 +3,170 @@
 #include "gl_func.hpp"
 #include <GL/gl.h>
 #include <GL/glext.h>
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <numeric>
 #include <print>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "glm/ext/matrix_float4x4.hpp"
 #include "glm/ext/matrix_transform.hpp"
 #include "glm/ext/vector_float3.hpp"
+#include "glm/gtc/packing.hpp"
 #include "glm/gtc/type_ptr.hpp"
+#include "profiler.hpp"
 #include "logger.hpp"
+#include "render_graph.hpp"
 
 enum {
-    SSBO_PARTICLE,
-    SSBO_DRAWCMD,
-    SSBO_DEADINDS,
-    SSBO_NUM
+    PARTICLE_STAGE_EMIT,
+    PARTICLE_STAGE_ARGS,
+    PARTICLE_STAGE_SIM
+};
+
+enum {
+    SORT_STAGE_KEYS,
+    SORT_STAGE_SCAN,
+    SORT_STAGE_SCATTER,
+    SORT_STAGE_PERMUTE,
+    SORT_STAGE_RESET
+};
+
+enum {
+    SPAWNER_STAGE_MOVE,
+    SPAWNER_STAGE_FORCE
 };
 
 using namespace glm;
 using namespace std;
 
-struct DrawCmd {
+#define PARTICLE_WG_SIZE 256
+// Frames of spawns the pool keeps room for on top of the live count, covers
+// the latency of its readback
+#define PARTICLE_GROW_FRAMES 8
+// Morton cell bits per axis of the reorder, the sort has 2^(3*bits) buckets
+#define PARTICLE_SORT_BITS 6
+// Side of the cube around the origin the reorder cells span, particles
+// outside of it share the border cells
+#define PARTICLE_SORT_EXTENT 128.0f
+
+// SSBO_DRAWCMD holds the alive count, the simulation dispatch arguments
+// and the draw of the visible particles
+struct IndirectCmd {
+    DrawCmd draw;
+    GLuint  dispatch_x;
+    GLuint  dispatch_y;
+    GLuint  dispatch_z;
+    GLuint  sim_count;
+    DrawCmd visible;
+};
+
+#define PACKED_SCALE_MAX 2.0f
+#define PACKED_LIFE_MAX 16.0f
+// The SoA and compact spawner words also hold the frames a particle waited
+// for its force update, see particle_storage.glsl
+#define SPAWNER_MASK 0x0fffffffu
+// Frames of dt the temporal LOD integrates over at most
+#define LOD_WAIT_FRAMES 16
+
+// INFO: PARTICLE_LAYOUT_COMPACT record, see particle_storage.glsl
+struct PackedParticle {
+    vec3    pos;
+    GLuint  vel_xy;
+    GLuint  vel_z_mass;
+    GLuint  scale_life;
+    GLuint  spawner;
+};
+
+// Binding of FrameBuf in particle_frame.glsl, after the SSBO_* bindings
+#define FRAME_BINDING 8
+
+// Binding of SpawnerStateBuf in spawner_state.glsl
+#define SPAWNER_BINDING 9
+// Binding of InstanceBuf in particle.comp and particles.vert
+#define INSTANCE_BINDING 10
+// Slots of the visible particles when there is no snapshot
+#define VISIBLE_BINDING 18
+// Binding of BatchDrawBuf in batch.vert
+#define BATCH_BINDING 17
+// Bindings of the scratch buffers of particle_sort.comp
+#define SORT_KEY_BINDING 11
+#define SORT_BUCKET_BINDING 12
+#define SORT_ORDER_BINDING 13
+#define PERMUTE_SRC_BINDING 14
+#define PERMUTE_DST_BINDING 15
+#define SPAWNER_WG_SIZE 256
+// Binding of CloudBoundsBuf in particle.comp
+#define BOUNDS_BINDING 16
+// INFO: keep in sync with the defines of particle.comp
+#define BOUNDS_EXTENT 1024.0
+#define BOUNDS_FIXED_SCALE 64.0
+// Units the bounds read back are grown by before culling a cloud, covers
+// how far particles move during the readback latency
+#define BOUNDS_MARGIN 2.0f
+
+// INFO: mirrors SpawnerState in spawner_state.glsl (std430)
+struct SpawnerStateGPU {
+    vec3    pos;
+    float   mass;
+    vec3    vel;
+    float   _p;
+};
+
+// INFO: mirrors FrameBuf and Spawner in particle_frame.glsl (std430)
+struct FrameParams {
+    mat4    transform;
+    mat4    proj;
+    mat4    view_proj;
+    float   dt;
+    float   particle_life;
+    GLuint  max_particles;
+    GLuint  spawn_count;
+    GLuint  spawner_num;
+    GLuint  frame;
+    float   lod_near;
+    GLuint  bounds_enabled;
+    GLuint  snapshot;
+    GLuint  _p[3];
+    vec4    frustum[6];
+    float   lod_elapsed[LOD_WAIT_FRAMES];
+};
+
+struct SpawnerParams {
+    vec3    pos;
+    float   mass;
+    GLuint  spawn_end;
+    GLuint  _p[3];
+};
+
+// INFO: mirrors CloudBounds in particle.comp (std430)
+struct CloudBoundsGPU {
+    GLuint  neg_min[3];
     GLuint  count;
-    GLuint  instanceCount;
-    GLuint  firstIndex;
-    GLint   baseVertex;
-    GLuint  baseInstance;
+    GLuint  max[3];
+    GLuint  _p0;
+    GLuint  sum_lo[3];
+    GLuint  _p1;
+    GLuint  sum_hi[3];
+    GLuint  _p2;
+};
+
+// Header of the SSBO_DEADINDS stack, the free indices follow it
+struct FreeList {
+    GLuint  count;
+    GLuint  slot_count;
 };
 
 string shaders_src[] = {
@@ -58,8 +194,78 @@ string shaders_src[] = {
     {
         #embed "../shaders/particles.frag" // 7
     },
+    {
+        #embed "../shaders/particle_storage.glsl" // 8
+    },
+    {
+        #embed "../shaders/particle_frame.glsl" // 9
+    },
+    {
+        #embed "../shaders/spawner.comp" // 10
+    },
+    {
+        #embed "../shaders/spawner_state.glsl" // 11
+    },
+    {
+        #embed "../shaders/particle_sort.comp" // 12
+    },
+    {
+        #embed "../shaders/batch.vert" // 13
+    },
+};
+
+// Snippets shaders can pull in with #include "name"
+static const pair<const char *, GLuint> shader_includes[] = {
+    {"particle_storage.glsl", 8},
+    {"particle_frame.glsl", 9},
+    {"spawner_state.glsl", 11},
+};
+
+// Particle streams and their bytes per particle in every layout
+static const GLuint particle_streams[] = {
+    SSBO_PARTICLE,
+    SSBO_PARTICLE_VEL,
+    SSBO_PARTICLE_SCALE,
+    SSBO_PARTICLE_SPAWNER,
+};
+static const GLsizeiptr particle_strides[PARTICLE_LAYOUT_NUM][4] = {
+    {sizeof(Particle), 0, 0, 0},
+    {sizeof(vec4), sizeof(vec4), sizeof(float), sizeof(GLuint)},
+    {sizeof(PackedParticle), 0, 0, 0},
 };
 
+/**
+ * \brief Adds the defines right after the #version line and expands
+ * #include "name" lines with the matching snippet
+ */
+static string preprocess_shader(const string &src, const string &defines) {
+    istringstream in(src);
+    string out, line;
+    bool is_first = true;
+    while (getline(in, line)) {
+        if (line.starts_with("#include \"")) {
+            const string name = line.substr(10, line.find('"', 10) - 10);
+            bool found = false;
+            for (const auto &[inc_name, id]: shader_includes) {
+                if (name == inc_name) {
+                    out += shaders_src[id];
+                    found = true;
+                }
+            }
+            if (!found)
+                ERR("Shader include '{}' doesnt exist", name);
+        }
+        else
+            out += line;
+        out += '\n';
+
+        if (is_first)
+            out += defines;
+        is_first = false;
+    }
+    return out;
+}
+
 static bool shader_compile_check(GLuint shade, GLuint type)
 {
     GLint success;
@@ -159,18 +365,92 @@ void Texture::GenerateMipMap() const {
     }
 }
 
-Program::Program(vector<GLuint> ids, vector<GLuint> types) {
-    if (ids.size() != types.size()) {
-        ERR("Number of ids({}) and types({}) mismatch",
-            ids.size(), types.size());
-        exit(1);
+// Programs alive in this process by their cache key
+static unordered_map<string, weak_ptr<const GLuint>> live_programs;
+
+/**
+ * \brief FNV-1a hash of the cache key, names the binary on disk
+ */
+static uint64_t hash_key(const string &key) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char c: key) {
+        hash ^= (unsigned char)c;
+        hash *= 0x100000001b3;
     }
+    return hash;
+}
 
+/**
+ * \return the program binary cache directory, empty if there is none
+ */
+static filesystem::path program_cache_dir() {
+    if (const char *const xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return filesystem::path(xdg) / "flower";
+    if (const char *const home = getenv("HOME"); home && *home)
+        return filesystem::path(home) / ".cache" / "flower";
+    return {};
+}
+
+/**
+ * \brief Loads a linked binary of the key from the disk cache
+ * \return the program or 0 on a miss
+ */
+static GLuint load_program_binary(const filesystem::path &path,
+                                  const uint64_t hash) {
+    ifstream in(path, ios::binary);
+    uint64_t file_hash = 0;
+    GLenum format = 0;
+    if (!in.read((char*)&file_hash, sizeof(file_hash)) ||
+        !in.read((char*)&format, sizeof(format)) || file_hash != hash)
+        return 0;
+    const vector<char> binary((istreambuf_iterator<char>(in)),
+                              istreambuf_iterator<char>());
+
+    const GLuint prog = glCreateProgram();
+    glProgramBinary(prog, format, binary.data(), binary.size());
+    GLint success = GL_FALSE;
+    glGetProgramiv(prog, GL_LINK_STATUS, &success);
+    if (success != GL_TRUE) {
+        // Driver update or corrupt file, relink from source
+        glDeleteProgram(prog);
+        return 0;
+    }
+    return prog;
+}
+
+static void store_program_binary(const filesystem::path &path,
+                                 const uint64_t hash, const GLuint prog) {
+    GLint length = 0;
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(prog, length, &length, &format, binary.data());
+
+    error_code err;
+    filesystem::create_directories(path.parent_path(), err);
+    // Write aside and rename, so a concurrent launch never reads half a file
+    filesystem::path tmp = path;
+    tmp += ".tmp";
+    ofstream out(tmp, ios::binary);
+    out.write((const char*)&hash, sizeof(hash));
+    out.write((const char*)&format, sizeof(format));
+    out.write(binary.data(), length);
+    out.close();
+    if (out)
+        filesystem::rename(tmp, path, err);
+    if (!out || err)
+        ERR("Cannot write program binary cache '{}'", path.string());
+}
+
+static GLuint compile_program(const vector<string> &srcs,
+                              const vector<GLuint> &types) {
     vector<GLuint> shaders;
-    shaders.reserve(ids.size());
-    for (unsigned int i = 0; i < ids.size(); ++i) {
+    shaders.reserve(srcs.size());
+    for (unsigned int i = 0; i < srcs.size(); ++i) {
         shaders.push_back(glCreateShader(types[i]));
-        const char *src = shaders_src[ids[i]].c_str();
+        const char *src = srcs[i].c_str();
 
         glShaderSource(shaders[i], 1, &src, NULL);
         glCompileShader(shaders[i]);
@@ -180,26 +460,69 @@ Program::Program(vector<GLuint> ids, vector<GLuint> types) {
         }
     }
 
-    program = glCreateProgram();
+    const GLuint prog = glCreateProgram();
+    glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     for (GLuint shader: shaders)
-        glAttachShader(program, shader);
-    glLinkProgram(program);
-    if (link_check(program)) {
+        glAttachShader(prog, shader);
+    glLinkProgram(prog);
+    if (link_check(prog)) {
         fflush(stdout);
         exit(1);
     }
 
-    glUseProgram(0);
     for (GLuint shader: shaders)
         glDeleteShader(shader);
+    return prog;
 }
 
-Program::Program(const Program &old) {
-    program = old.program;
-}
+Program::Program(vector<GLuint> ids, vector<GLuint> types,
+                 const string &defines) {
+    if (ids.size() != types.size()) {
+        ERR("Number of ids({}) and types({}) mismatch",
+            ids.size(), types.size());
+        exit(1);
+    }
+
+    // Binaries only load on the driver that produced them
+    string key = string((const char*)glGetString(GL_VENDOR)) + '\n' +
+        (const char*)glGetString(GL_RENDERER) + '\n' +
+        (const char*)glGetString(GL_VERSION) + '\n';
+    vector<string> srcs;
+    srcs.reserve(ids.size());
+    for (unsigned int i = 0; i < ids.size(); ++i) {
+        srcs.push_back(preprocess_shader(shaders_src[ids[i]], defines));
+        key += to_string(types[i]) + '\n' + srcs.back();
+    }
+
+    handle = live_programs[key].lock();
+    if (handle) {
+        program = *handle;
+        return;
+    }
+
+    const uint64_t hash = hash_key(key);
+    filesystem::path path = program_cache_dir();
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats == 0)
+        path.clear();
+    else if (!path.empty())
+        path /= format("{:016x}.bin", hash);
+
+    program = path.empty() ? 0 : load_program_binary(path, hash);
+    if (!program) {
+        program = compile_program(srcs, types);
+        if (!path.empty())
+            store_program_binary(path, hash, program);
+    }
+    glUseProgram(0);
 
-Program::~Program() {
-    glDeleteProgram(program);
+    handle = shared_ptr<const GLuint>(new GLuint(program),
+                                      [](const GLuint *prog) {
+        glDeleteProgram(*prog);
+        delete prog;
+    });
+    live_programs[key] = handle;
 }
 
 void Program::Use() const {
@@ -219,17 +542,252 @@ void Program::Dispatch(const ivec3 wg) {
     glDispatchCompute(wg.x, wg.y, wg.z);
 }
 
+void Program::DispatchIndirect(const GLintptr offset) {
+    glDispatchComputeIndirect(offset);
+}
+
 void Program::FinishComputes(const GLuint type) {
+    PROFILE_CPU("FinishComputes");
     glMemoryBarrier(type);
+    RecordBarrier(type);
 }
 
 GLuint Program::GetUniformLoc(const char *name) const {
+    // Only ask the driver once per name
+    const auto cached = uniform_locs.find(name);
+    if (cached != uniform_locs.end())
+        return cached->second;
+
     int i = glGetUniformLocation(program, name);
     if (i < 0)
         ERR("Uniform with name '{}' doesnt exist", name);
+    uniform_locs[name] = i;
     return i;
 }
 
+FrameRing::FrameRing(const GLsizeiptr size, const GLuint regions)
+    : fences(regions, nullptr) {
+    // Regions are bound as ranges, so keep them at the offset alignment
+    GLint align = 1;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &align);
+    GLint ubo_align = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align);
+    align = glm::max(align, ubo_align);
+    region = (size + align - 1) / align * align;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+        GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &buf);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, region * regions, nullptr, flags);
+    data = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0,
+                                   region * regions, flags);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (!data) {
+        ERR("Cannot map frame ring of {} bytes", region * regions);
+        exit(1);
+    }
+}
+
+FrameRing::~FrameRing() {
+    for (GLsync fence: fences)
+        if (fence)
+            glDeleteSync(fence);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buf);
+}
+
+/**
+ * \brief Fences everything issued so far with the current region and moves
+ * on to the next one, waiting for the GPU to finish reading it
+ * \return pointer to the start of the region
+ */
+char *FrameRing::Next() {
+    if (fences[cur])
+        glDeleteSync(fences[cur]);
+    fences[cur] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    cur = (cur + 1) % fences.size();
+    if (fences[cur]) {
+        while (glClientWaitSync(fences[cur], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fences[cur]);
+        fences[cur] = nullptr;
+    }
+    return data + cur * region;
+}
+
+/**
+ * \brief Binds the start of the current region
+ * \param target GL_SHADER_STORAGE_BUFFER or GL_UNIFORM_BUFFER
+ * \param binding index of the binding point
+ * \param size bytes of the region that were written
+ */
+void FrameRing::Bind(const GLenum target, const GLuint binding,
+                     const GLsizeiptr size) const {
+    glBindBufferRange(target, binding, buf, cur * region, size);
+}
+
+GLsizeiptr FrameRing::GetSize() const {
+    return region;
+}
+
+BufferReadback::BufferReadback(const GLsizeiptr _size) : size(_size) {
+    // Copies land in client memory that stays mapped, so a finished
+    // readback is read without any GL call
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT |
+        GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &buf);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr,
+                    flags | GL_CLIENT_STORAGE_BIT);
+    data = (const char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size,
+                                         flags);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (!data) {
+        ERR("Cannot map readback of {} bytes", size);
+        exit(1);
+    }
+}
+
+BufferReadback::~BufferReadback() {
+    if (fence)
+        glDeleteSync(fence);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buf);
+}
+
+/**
+ * \brief Queues a copy of part of a buffer, Poll returns it once the GPU
+ * got there. Ignored while an earlier copy is still in flight. Issues no
+ * barrier, run it from a graph pass with a transfer read of src
+ * \param src buffer to copy from
+ * \param offset bytes into src
+ * \param len bytes to copy, at most the size of the readback
+ */
+void BufferReadback::Request(const GLuint src, const GLintptr offset,
+                             const GLsizeiptr len) {
+    if (fence)
+        return;
+    glBindBuffer(GL_COPY_READ_BUFFER, src);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, 0,
+                        glm::min(len, size));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/**
+ * \brief Never waits
+ * \return the requested copy if it has arrived, else null. It stays valid
+ * until the next Request
+ */
+const void *BufferReadback::Poll() {
+    if (!fence)
+        return nullptr;
+    const GLenum status = glClientWaitSync(fence,
+                                           GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return nullptr;
+    glDeleteSync(fence);
+    fence = nullptr;
+    return data;
+}
+
+SpawnerState::SpawnerState(const vec3 *pos, const vec3 *vel,
+                           const float *mass, const GLuint _num,
+                           const string &defines)
+    : prog({10}, {GL_COMPUTE_SHADER}, defines), num(_num),
+        readback(_num * sizeof(SpawnerStateGPU)) {
+    vector<SpawnerStateGPU> state(num);
+    for (GLuint i = 0; i < num; ++i) {
+        state[i].pos = pos[i];
+        state[i].mass = mass[i];
+        state[i].vel = vel[i];
+    }
+    glGenBuffers(1, &buf);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, num * sizeof(SpawnerStateGPU),
+                 state.data(), GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+SpawnerState::~SpawnerState() {
+    glDeleteBuffers(1, &buf);
+}
+
+/**
+ * \brief Moves every spawner, then applies the forces, in two passes so
+ * no spawner sees another one half moved. Both write the "spawners"
+ * resource of the graph, the passes reading the state declare it too
+ * \param graph runs the passes with its next Execute
+ */
+void SpawnerState::Update(const float dt, RenderGraph *graph) {
+    const GLuint state = graph->Import("spawners", GRAPH_RESOURCE_BUFFER);
+    const auto dispatch = [this, dt](const GLuint stage) {
+        prog.Use();
+        Bind();
+        prog.Uniform("dt", dt);
+        prog.Uniform("spawner_num", num);
+        prog.Uniform("stage", stage);
+        Program::Dispatch({(GLint)((num - 1)/SPAWNER_WG_SIZE + 1), 1, 1});
+    };
+    graph->AddPass("spawner_move", {GraphWrite(state, GRAPH_ACCESS_SSBO)},
+                   [dispatch]() { dispatch(SPAWNER_STAGE_MOVE); });
+    graph->AddPass("spawner_force", {GraphWrite(state, GRAPH_ACCESS_SSBO)},
+                   [dispatch]() { dispatch(SPAWNER_STAGE_FORCE); });
+}
+
+void SpawnerState::Bind() const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SPAWNER_BINDING, buf);
+}
+
+/**
+ * \brief Queues a copy of the state once the passes of Update ran,
+ * PollReadback returns it once the GPU got there. Adds no pass until
+ * PollReadback handed out the last copy, so its barrier is only issued
+ * once per copy
+ * \param graph runs the copy with its next Execute
+ */
+void SpawnerState::RequestReadback(RenderGraph *graph) {
+    if (readback_pending)
+        return;
+    readback_pending = true;
+    graph->AddPass("spawner_readback", {
+        GraphRead(graph->Import("spawners", GRAPH_RESOURCE_BUFFER),
+                  GRAPH_ACCESS_TRANSFER),
+    }, [this]() {
+        readback.Request(buf, 0, num * sizeof(SpawnerStateGPU));
+    });
+}
+
+/**
+ * \brief Hands out the requested copy if it has arrived, never waits
+ * \param pos, vel receive the state of every spawner
+ * \return true if they were written
+ */
+bool SpawnerState::PollReadback(vec3 *pos, vec3 *vel) {
+    const SpawnerStateGPU *const state =
+        (const SpawnerStateGPU*)readback.Poll();
+    if (!state)
+        return false;
+    readback_pending = false;
+    for (GLuint i = 0; i < num; ++i) {
+        pos[i] = state[i].pos;
+        vel[i] = state[i].vel;
+    }
+    return true;
+}
+
+GLuint SpawnerState::GetCount() const {
+    return num;
+}
+
 void Program::Uniform(const char *name, GLuint data) const {
     glUniform1ui(GetUniformLoc(name), data);
 }
@@ -259,6 +817,11 @@ void Program::Uniform(const char *name, const float *data, GLint size,
 }
 
 
+void Program::Uniform(const char *name, const GLuint *data,
+                      GLint size) const {
+    glUniform1uiv(GetUniformLoc(name), size, data);
+}
+
 void Program::Uniform(const char *name, const mat4 data) const {
     glUniformMatrix4fv(GetUniformLoc(name),
                        1,
@@ -271,6 +834,30 @@ static void enable_attrib(GLuint ind, GLint comps, GLuint64 offset) {
     glVertexAttribPointer(ind, comps, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offset);
 }
 
+/**
+ * \return true if the driver lists the extension
+ */
+static bool has_extension(const char *const name) {
+    GLint exts = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &exts);
+    for (GLint i = 0; i < exts; ++i)
+        if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name))
+            return true;
+    return false;
+}
+
+/**
+ * \return the camera's view transform, with its projection first unless
+ * it's for billboards
+ */
+static mat4 camera_transform(const bool projection) {
+    mat4 mvp = projection ? cam.proj : mat4(1.0);
+    mvp = rotate(mvp, cam.rot.x, vec3(1, 0, 0));
+    mvp = rotate(mvp, cam.rot.y, vec3(0, 1, 0));
+    mvp = rotate(mvp, cam.rot.z, vec3(0, 0, 1));
+    return translate(mvp, cam.pos);
+}
+
 Mesh::Mesh(const vector<Vertex> &verts,
            const vector<GLuint> &elems,
            const shared_ptr<Program> prog)
@@ -296,22 +883,25 @@ Mesh::Mesh(const vector<Vertex> &verts,
     elem_cnt = elems.size();
 }
 
-void Mesh::UpdateProjection() const {
+void Mesh::Bind() const {
     program->Use();
     glBindVertexArray(id);
-    mat4 mvp = mat4(1.0);
-    if (!still) {
-        if (!billboard)
-            mvp = cam.proj;
-        else 
-            program->Uniform("u_proj", cam.proj);
-        mvp = rotate(mvp, cam.rot.x, vec3(1, 0, 0));
-        mvp = rotate(mvp, cam.rot.y, vec3(0, 1, 0));
-        mvp = rotate(mvp, cam.rot.z, vec3(0, 0, 1));
-        mvp = translate(mvp, cam.pos);
-        mvp = translate(mvp, pos);
-    }
-    program->Uniform("u_transform", mvp);
+}
+
+/**
+ * \return the u_transform matrix, billboards leave the projection out
+ */
+mat4 Mesh::GetTransform() const {
+    if (still)
+        return mat4(1.0);
+    return translate(camera_transform(!billboard), pos);
+}
+
+void Mesh::UpdateProjection() const {
+    Bind();
+    if (!still && billboard)
+        program->Uniform("u_proj", cam.proj);
+    program->Uniform("u_transform", GetTransform());
 }
 
 void Mesh::Draw() const {
@@ -324,80 +914,888 @@ GLuint Mesh::GetElemCnt() const {
     return elem_cnt;
 }
 
+/**
+ * \param frag_id embedded fragment shader the draws share
+ */
+MeshBatch::MeshBatch(const GLuint frag_id)
+    : draw_id(has_extension("GL_ARB_shader_draw_parameters")),
+        prog({13, frag_id}, {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER},
+             draw_id ? "#define BATCH_DRAW_ID\n" : "") {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenBuffers(1, &ebo);
+    glGenBuffers(1, &cmds);
+    glGenBuffers(1, &offset_buf);
+    if (!draw_id)
+        ERR("No GL_ARB_shader_draw_parameters, drawing the batch one "
+            "mesh at a time");
+}
+
+MeshBatch::~MeshBatch() {
+    glDeleteVertexArrays(1, &vao);
+    GLuint bufs[] = {vbo, ebo, cmds, offset_buf};
+    glDeleteBuffers(size(bufs), bufs);
+}
+
+/**
+ * \brief Appends a mesh to the batch, it's uploaded with the next Draw
+ * \param pos translation of the mesh
+ * \return index of its draw
+ */
+GLuint MeshBatch::Add(const vector<Vertex> &verts,
+                      const vector<GLuint> &elems, const vec3 pos) {
+    DrawCmd cmd = {};
+    cmd.count = elems.size();
+    cmd.instanceCount = 1;
+    cmd.firstIndex = this->elems.size();
+    cmd.baseVertex = this->verts.size();
+    draw_cmds.push_back(cmd);
+    positions.push_back(pos);
+    this->verts.insert(this->verts.end(), verts.begin(), verts.end());
+    this->elems.insert(this->elems.end(), elems.begin(), elems.end());
+    dirty = true;
+    return draw_cmds.size() - 1;
+}
+
+/**
+ * \brief Uploads every mesh into the shared vertex, index, command and
+ * offset buffers
+ */
+void MeshBatch::Upload() {
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, verts.size()*sizeof(Vertex),
+                 verts.data(), GL_STATIC_DRAW);
+    enable_attrib(0, 3, offsetof(Vertex, pos));
+    enable_attrib(1, 2, offsetof(Vertex, uv));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, elems.size()*sizeof(GLuint),
+                 elems.data(), GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cmds);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, draw_cmds.size()*sizeof(DrawCmd),
+                 draw_cmds.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    // Padded to vec4 as according to glsl std430
+    vector<vec4> offsets(positions.size());
+    for (GLuint i = 0; i < positions.size(); ++i)
+        offsets[i] = vec4(positions[i], 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, offset_buf);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, offsets.size()*sizeof(vec4),
+                 offsets.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    dirty = false;
+}
+
+/**
+ * \brief Draws every mesh with one call. The camera transform is a
+ * uniform and the offsets of the draws only change with Add, so a frame
+ * uploads nothing and its cost barely grows with the number of meshes
+ */
+void MeshBatch::Draw() {
+    if (draw_cmds.empty())
+        return;
+    if (dirty)
+        Upload();
+
+    prog.Use();
+    prog.Uniform("u_view_proj", camera_transform(true));
+    glBindVertexArray(vao);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BATCH_BINDING, offset_buf);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cmds);
+    if (draw_id)
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr,
+                                    draw_cmds.size(), 0);
+    else
+        for (GLuint i = 0; i < draw_cmds.size(); ++i) {
+            prog.Uniform("u_draw", i);
+            glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                   (void*)(i * sizeof(DrawCmd)));
+        }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
 Mesh::~Mesh() {
     glDeleteVertexArrays(1, &id);
 }
 
-ParticleSystem::ParticleSystem(unique_ptr<Mesh> _mesh, const GLuint _max)
-    : mesh(std::move(_mesh)), prog({4}, {GL_COMPUTE_SHADER}),
-        max(_max) {
-    mesh->billboard = true;
-    glGenBuffers(SSBO_NUM, ssbo);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER,
-                 ssbo[SSBO_PARTICLE]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER,
-                 max * sizeof(Particle),
-                 nullptr, GL_DYNAMIC_DRAW);
-    BindSSBOBase(SSBO_PARTICLE);
+/**
+ * \return true if the driver runs KHR_shader_subgroup ballots in compute
+ */
+static bool has_subgroup_ballot() {
+    if (!has_extension("GL_KHR_shader_subgroup"))
+        return false;
+
+    GLint stages = 0;
+    GLint features = 0;
+    glGetIntegerv(GL_SUBGROUP_SUPPORTED_STAGES_KHR, &stages);
+    glGetIntegerv(GL_SUBGROUP_SUPPORTED_FEATURES_KHR, &features);
+    const GLint needed = GL_SUBGROUP_FEATURE_BASIC_BIT_KHR |
+        GL_SUBGROUP_FEATURE_BALLOT_BIT_KHR;
+    return (stages & GL_COMPUTE_SHADER_BIT) && (features & needed) == needed;
+}
 
+/**
+ * \brief Resolves the counter aggregation the driver can run. Auto and
+ * unsupported subgroups fall back to workgroups
+ */
+ParticleAtomics ParticleSystem::PickAtomics(const ParticleAtomics atomics) {
+    if (atomics != PARTICLE_ATOMICS_AUTO &&
+        atomics != PARTICLE_ATOMICS_SUBGROUP)
+        return atomics;
+    static const bool subgroup = has_subgroup_ballot();
+    if (subgroup)
+        return PARTICLE_ATOMICS_SUBGROUP;
+    if (atomics == PARTICLE_ATOMICS_SUBGROUP)
+        ERR("No subgroup ballots in compute shaders, aggregating the "
+            "particle atomics per workgroup");
+    return PARTICLE_ATOMICS_WORKGROUP;
+}
 
-    DrawCmd cmd = {0};
-    cmd.count = 6;
+/**
+ * \brief Extracts the frustum planes of a projection, facing inwards and
+ * normalized so they give distances
+ * \param proj projection without the view transform
+ * \param planes receives left, right, bottom, top, near and far
+ */
+static void frustum_planes(const mat4 &proj, vec4 *planes) {
+    const vec4 row[4] = {
+        vec4(proj[0][0], proj[1][0], proj[2][0], proj[3][0]),
+        vec4(proj[0][1], proj[1][1], proj[2][1], proj[3][1]),
+        vec4(proj[0][2], proj[1][2], proj[2][2], proj[3][2]),
+        vec4(proj[0][3], proj[1][3], proj[2][3], proj[3][3]),
+    };
+    for (GLuint i = 0; i < 3; ++i) {
+        planes[2*i] = row[3] + row[i];
+        planes[2*i + 1] = row[3] - row[i];
+    }
+    for (GLuint i = 0; i < 6; ++i)
+        planes[i] /= length(vec3(planes[i]));
+}
+
+/**
+ * \return the shader defines selecting the counter aggregation
+ */
+static string AtomicsDefines(const ParticleAtomics atomics) {
+    switch (atomics) {
+        case PARTICLE_ATOMICS_SUBGROUP:
+            return "#define PARTICLE_SUBGROUP\n";
+        case PARTICLE_ATOMICS_WORKGROUP:
+            return "#define PARTICLE_WG_AGGREGATE\n";
+        default:
+            return "";
+    }
+}
+
+ParticleSystem::ParticleSystem(unique_ptr<Mesh> _mesh, const GLuint _max,
+                               const ParticleLayout _layout,
+                               const SpawnerState *_spawner_state,
+                               const GLuint initial,
+                               const ParticleAtomics atomics)
+    : mesh(std::move(_mesh)),
+        prog({4}, {GL_COMPUTE_SHADER}, LayoutDefines(_layout) +
+             (_spawner_state ? "#define SPAWNER_STATE\n" : "") +
+             AtomicsDefines(PickAtomics(atomics))),
+        spawner_state(_spawner_state), ssbo(), max(_max), capacity(0),
+        layout(_layout), live_readback(sizeof(GLuint)) {
+    mesh->billboard = true;
+
+    IndirectCmd cmd = {};
+    cmd.draw.count = 6;
+    cmd.visible.count = 6;
+    glGenBuffers(1, &ssbo[SSBO_DRAWCMD]);
     glBindBuffer(GL_DRAW_INDIRECT_BUFFER,
                  ssbo[SSBO_DRAWCMD]);
     glBufferData(GL_DRAW_INDIRECT_BUFFER,
-                 sizeof(DrawCmd),
+                 sizeof(IndirectCmd),
                  &cmd, GL_DYNAMIC_DRAW);
-    BindSSBOBase(SSBO_DRAWCMD);
 
-    std::vector<GLint> is_ind_dead;
-    is_ind_dead.insert(is_ind_dead.begin(), max + 1, 0);
+    glGenBuffers(2, draw_args);
+    for (GLuint i = 0; i < 2; ++i) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_args[i]);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawCmd),
+                     &cmd.visible, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER,
+                 0);
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER,
-                 ssbo[SSBO_DEADINDS]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER,
-                 max * sizeof(GLint) + sizeof(float),
-                 is_ind_dead.data(), GL_DYNAMIC_DRAW);
-    BindSSBOBase(SSBO_DEADINDS);
+    Grow(initial ? glm::min(initial, max) : max);
+    MakeDrawProgram();
 
+    // Only the counters need a value, the stack fills as particles die
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[SSBO_DEADINDS]);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                      GL_UNSIGNED_INT, nullptr);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER,
                  0);
-    glBindBuffer(GL_DRAW_INDIRECT_BUFFER,
-                 0);
+}
+
+/**
+ * \brief Reallocates a buffer of the pool, keeping its first bytes
+ * \param id SSBO_* of the buffer
+ * \param size new size in bytes
+ * \param keep bytes copied over on the GPU
+ */
+void ParticleSystem::ResizeSSBO(const GLuint id, const GLsizeiptr size,
+                                const GLsizeiptr keep) {
+    GLuint buf;
+    glGenBuffers(1, &buf);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buf);
+    glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+    if (keep > 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, ssbo[id]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                            keep);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &ssbo[id]);
+    ssbo[id] = buf;
+}
+
+/**
+ * \brief Reallocates the pool for more slots, keeping every slot, the free
+ * stack and the alive list. Nothing leaves the GPU
+ * \param new_capacity slots of the pool from now on
+ */
+void ParticleSystem::Grow(const GLuint new_capacity) {
+    PROFILE_CPU("ParticleGrow");
+    for (GLuint i = 0; i < size(particle_streams); ++i) {
+        const GLsizeiptr stride = particle_strides[layout][i];
+        if (stride)
+            ResizeSSBO(particle_streams[i], new_capacity * stride,
+                       capacity * stride);
+    }
+    ResizeSSBO(SSBO_DEADINDS,
+               sizeof(FreeList) + new_capacity * sizeof(GLuint),
+               capacity ? sizeof(FreeList) + capacity * sizeof(GLuint) : 0);
+    ResizeSSBO(SSBO_ALIVE, new_capacity * sizeof(GLuint),
+               capacity * sizeof(GLuint));
+    ResizeSSBO(SSBO_ALIVE_NEXT, new_capacity * sizeof(GLuint), 0);
+    // The next reorder allocates them at the new size
+    glDeleteBuffers(SSBO_NUM, sort_spare);
+    fill(begin(sort_spare), end(sort_spare), 0);
+
+    AllocSnapshot(new_capacity);
+
+    if (capacity)
+        INF("Particle pool grew from {} to {} slots", capacity,
+            new_capacity);
+    capacity = new_capacity;
 }
 
 ParticleSystem::~ParticleSystem() {
     glDeleteBuffers(SSBO_NUM, ssbo);
+    glDeleteBuffers(SSBO_NUM, sort_spare);
+    glDeleteBuffers(2, instances);
+    glDeleteBuffers(1, &visible_buf);
+    glDeleteBuffers(2, draw_args);
+    glDeleteBuffers(1, &bounds_buf);
+    glDeleteVertexArrays(1, &pull_vao);
 }
 
 void ParticleSystem::Update(const float dt, const vec3 *pos,
                             const float *mass,
                             const vec3 *vel,
                             const GLuint spawner_len,
-                            const GLuint own_spawner,
-                            const float spawn_time,
+                            const GLuint *spawn_ends,
                             const float particle_life) {
-    prog.Use();
+    (void)vel;
+    // Grow before the spawns when a recent live count plus the spawns of
+    // the frames it may lag behind no longer fit
+    const GLuint *const live = (const GLuint*)live_readback.Poll();
+    if (live && capacity < max) {
+        const uint64_t need = *live +
+            (uint64_t)PARTICLE_GROW_FRAMES * last_spawn_count;
+        GLuint new_capacity = capacity;
+        while (new_capacity < need && new_capacity < max)
+            new_capacity = glm::min<uint64_t>(new_capacity * 2ull, max);
+        // Right away, the frame's parameters need the new capacity
+        if (new_capacity != capacity) {
+            graph.AddPass("grow", {
+                GraphWrite(graph.Import("particles", GRAPH_RESOURCE_BUFFER),
+                           GRAPH_ACCESS_TRANSFER),
+                GraphWrite(graph.Import("free_list", GRAPH_RESOURCE_BUFFER),
+                           GRAPH_ACCESS_TRANSFER),
+                GraphWrite(graph.Import("alive", GRAPH_RESOURCE_BUFFER),
+                           GRAPH_ACCESS_TRANSFER),
+            }, [this, new_capacity]() { Grow(new_capacity); });
+            graph.Execute();
+        }
+    }
+    if (bounds_readback) {
+        const CloudBoundsGPU *const clouds =
+            (const CloudBoundsGPU*)bounds_readback->Poll();
+        if (clouds)
+            ReadBounds(clouds);
+    }
 
-    for (GLuint i = 0; i < SSBO_NUM; ++i)
-        BindSSBOBase(i);
+    // Every spawner's emission is worked out on the CPU, so all of it runs
+    // in one parallel dispatch
+    const GLuint spawn_count = spawner_len ?
+        glm::min(spawn_ends[spawner_len - 1], max) : 0;
+    last_spawn_count = spawn_count;
+
+    // Write everything the passes need once into the ring
+    const GLsizeiptr frame_size = sizeof(FrameParams) +
+        spawner_len * sizeof(SpawnerParams);
+    if (!ring || ring->GetSize() < frame_size)
+        ring = make_unique<FrameRing>(frame_size * 2);
+    FrameParams *const params = (FrameParams*)ring->Next();
+    params->transform = mesh->GetTransform();
+    params->proj = cam.proj;
+    params->view_proj = cam.proj * params->transform;
+    params->dt = dt;
+    params->particle_life = particle_life;
+    params->max_particles = capacity;
+    params->spawn_count = spawn_count;
+    params->spawner_num = spawner_len;
+    params->frame = frame++;
+    params->lod_near = lod_near;
+    // Shifts this frame's dt in front of the ones a particle may have
+    // waited through
+    static_assert(sizeof(lod_dts) == sizeof(FrameParams::lod_elapsed));
+    copy_backward(begin(lod_dts), end(lod_dts) - 1, end(lod_dts));
+    lod_dts[0] = dt;
+    partial_sum(begin(lod_dts), end(lod_dts), params->lod_elapsed);
+    params->bounds_enabled = bounds_enabled && spawner_len;
+    params->snapshot = pipelined;
+    if (culling)
+        frustum_planes(cam.proj, params->frustum);
+    else
+        fill(begin(params->frustum), end(params->frustum), vec4(0, 0, 0, 1));
+    SpawnerParams *const spawner_params = (SpawnerParams*)(params + 1);
+    for (GLuint i = 0; i < spawner_len; ++i) {
+        // The passes read GPU resident spawners from their own buffer
+        if (!spawner_state) {
+            spawner_params[i].pos = pos[i];
+            spawner_params[i].mass = mass[i];
+        }
+        spawner_params[i].spawn_end = spawn_ends[i];
+    }
+    frame_size_used = frame_size;
+
+    const GLuint particles = graph.Import("particles", GRAPH_RESOURCE_BUFFER);
+    const GLuint free_list = graph.Import("free_list", GRAPH_RESOURCE_BUFFER);
+    const GLuint alive = graph.Import("alive", GRAPH_RESOURCE_BUFFER);
+    const GLuint draw_cmd = graph.Import("draw_cmd", GRAPH_RESOURCE_BUFFER);
+    const GLuint bounds_res = graph.Import("bounds", GRAPH_RESOURCE_BUFFER);
+    const GLuint args = graph.Import("draw_args", GRAPH_RESOURCE_BUFFER);
+    // Written by the passes SpawnerState::Update adds to the graph of the
+    // pool. A shadow pool only runs after that graph waited for them
+    const GLuint spawner_res = graph.Import("spawners",
+                                            GRAPH_RESOURCE_BUFFER);
+
+    // Reduced from nothing every frame, the readback keeps the last result
+    const bool reduce_bounds = bounds_enabled && spawner_len;
+    if (reduce_bounds) {
+        if (bounds_num != spawner_len) {
+            glDeleteBuffers(1, &bounds_buf);
+            glGenBuffers(1, &bounds_buf);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, bounds_buf);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         spawner_len * sizeof(CloudBoundsGPU), nullptr,
+                         GL_DYNAMIC_COPY);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            bounds_readback = make_unique<BufferReadback>(
+                spawner_len * sizeof(CloudBoundsGPU));
+            bounds_num = spawner_len;
+        }
+        graph.AddPass("clear_bounds",
+                      {GraphWrite(bounds_res, GRAPH_ACCESS_TRANSFER)},
+                      [this]() {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, bounds_buf);
+            glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI,
+                              GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        });
+    }
+
+    // Sorts the survivors of the last simulation, so the slots the draw
+    // reads stay valid until the next Update
+    if (reorder_interval && ++frames_since_reorder >= reorder_interval) {
+        frames_since_reorder = 0;
+        Reorder();
+    }
+
+    // Write the snapshot the last Draw didn't read, so this frame's
+    // simulation can overlap it
+    cur = 1 - cur;
+    const GLuint snapshot = ImportSnapshot();
+    const auto use_stage = [this](const GLuint stage) {
+        prog.Use();
+        BindSSBOs();
+        prog.Uniform("stage", stage);
+    };
+
+    // Spawn first so the simulation never pushes while spawns pop
+    if (spawn_count > 0) {
+        vector<GraphUse> emit_uses = {
+            GraphWrite(particles, GRAPH_ACCESS_SSBO),
+            GraphWrite(free_list, GRAPH_ACCESS_SSBO),
+            GraphWrite(alive, GRAPH_ACCESS_SSBO),
+            GraphWrite(draw_cmd, GRAPH_ACCESS_SSBO),
+        };
+        if (spawner_state)
+            emit_uses.push_back(GraphRead(spawner_res, GRAPH_ACCESS_SSBO));
+        graph.AddPass("emit", emit_uses, [use_stage, spawn_count]() {
+            use_stage(PARTICLE_STAGE_EMIT);
+            Program::Dispatch({(GLint)((spawn_count - 1)/PARTICLE_WG_SIZE + 1),
+                               1, 1});
+        });
+    }
+
+    // Size the simulation by the alive list instead of the whole pool
+    graph.AddPass("args", {
+        GraphRead(free_list, GRAPH_ACCESS_SSBO),
+        GraphWrite(draw_cmd, GRAPH_ACCESS_SSBO),
+    }, [use_stage]() {
+        use_stage(PARTICLE_STAGE_ARGS);
+        Program::Dispatch({1, 1, 1});
+    });
+
+    vector<GraphUse> sim_uses = {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphWrite(draw_cmd, GRAPH_ACCESS_SSBO),
+        GraphWrite(particles, GRAPH_ACCESS_SSBO),
+        GraphWrite(free_list, GRAPH_ACCESS_SSBO),
+        GraphWrite(alive, GRAPH_ACCESS_SSBO),
+        GraphWrite(snapshot, GRAPH_ACCESS_SSBO),
+    };
+    if (reduce_bounds)
+        sim_uses.push_back(GraphWrite(bounds_res, GRAPH_ACCESS_SSBO));
+    if (spawner_state)
+        sim_uses.push_back(GraphRead(spawner_res, GRAPH_ACCESS_SSBO));
+    graph.AddPass("sim", sim_uses, [this, use_stage]() {
+        use_stage(PARTICLE_STAGE_SIM);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, ssbo[SSBO_DRAWCMD]);
+        Program::DispatchIndirect(offsetof(IndirectCmd, dispatch_x));
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+        // Survivors were compacted into the next list
+        swap(ssbo[SSBO_ALIVE], ssbo[SSBO_ALIVE_NEXT]);
+    });
+
+    // Only the snapshot and the counters were written for the draw, the
+    // copy gives it an indirect command the next frame won't touch
+    graph.AddPass("copy_draw", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_TRANSFER),
+        GraphWrite(args, GRAPH_ACCESS_TRANSFER),
+    }, [this]() {
+        glBindBuffer(GL_COPY_READ_BUFFER, ssbo[SSBO_DRAWCMD]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, draw_args[cur]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                            offsetof(IndirectCmd, visible), 0,
+                            sizeof(DrawCmd));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    });
+    if (capacity < max)
+        graph.AddPass("live_readback",
+                      {GraphRead(draw_cmd, GRAPH_ACCESS_TRANSFER)}, [this]() {
+            live_readback.Request(ssbo[SSBO_DRAWCMD],
+                                  offsetof(IndirectCmd, draw) +
+                                  offsetof(DrawCmd, instanceCount),
+                                  sizeof(GLuint));
+        });
+    if (reduce_bounds)
+        graph.AddPass("bounds_readback",
+                      {GraphRead(bounds_res, GRAPH_ACCESS_TRANSFER)},
+                      [this]() {
+            bounds_readback->Request(bounds_buf, 0,
+                                     bounds_num * sizeof(CloudBoundsGPU));
+        });
+    graph.Execute();
+}
+
+static float unordered_float(const GLuint u) {
+    const GLuint bits = (u & 0x80000000u) ? u & 0x7fffffffu : ~u;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/**
+ * \brief Decodes the bounds the simulation reduced a few frames ago
+ */
+void ParticleSystem::ReadBounds(const CloudBoundsGPU *clouds) {
+    bounds.resize(bounds_num);
+    for (GLuint i = 0; i < bounds_num; ++i) {
+        const CloudBoundsGPU &cloud = clouds[i];
+        CloudBounds &b = bounds[i];
+        b.count = cloud.count;
+        if (!b.count) {
+            b = {};
+            continue;
+        }
+        for (GLuint k = 0; k < 3; ++k) {
+            b.min[k] = unordered_float(~cloud.neg_min[k]);
+            b.max[k] = unordered_float(cloud.max[k]);
+            const uint64_t sum = (uint64_t)cloud.sum_hi[k] << 32 |
+                cloud.sum_lo[k];
+            b.centroid[k] = sum / (BOUNDS_FIXED_SCALE * b.count) -
+                BOUNDS_EXTENT/2;
+        }
+    }
+}
+
+/**
+ * \brief Reduces the AABB, live count and centroid of every spawner's
+ * particles in the simulation and reads them back asynchronously, see
+ * IsAnyCloudVisible
+ */
+void ParticleSystem::SetBoundsReadback(const bool enable) {
+    bounds_enabled = enable;
+    if (!enable)
+        bounds.clear();
+}
+
+/**
+ * \return the bounds of every spawner's particles, one or two frames
+ * behind. Empty until the first readback arrived
+ */
+const vector<CloudBounds> &ParticleSystem::GetBounds() const {
+    return bounds;
+}
+
+/**
+ * \return false if the last bounds put every cloud outside the frustum
+ */
+bool ParticleSystem::IsAnyCloudVisible() const {
+    if (!culling || bounds.empty())
+        return true;
+    // Planes of the pool's space, the view transform folded in
+    vec4 planes[6];
+    frustum_planes(cam.proj, planes);
+    const mat4 to_view = transpose(mesh->GetTransform());
+    for (vec4 &plane: planes)
+        plane = to_view * plane;
+
+    for (const CloudBounds &b: bounds) {
+        if (!b.count)
+            continue;
+        bool inside = true;
+        for (GLuint i = 0; i < 6 && inside; ++i) {
+            const vec3 n = vec3(planes[i]);
+            // Corner of the box furthest along the plane's normal
+            vec3 corner;
+            for (GLuint k = 0; k < 3; ++k)
+                corner[k] = n[k] >= 0 ? b.max[k] + BOUNDS_MARGIN :
+                    b.min[k] - BOUNDS_MARGIN;
+            inside = dot(n, corner) + planes[i].w >= 0;
+        }
+        if (inside)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * \brief Enables the temporal LOD of the simulation. Particles past near
+ * units from the camera sum the spawner forces every 2nd frame, past twice
+ * that every 4th and past four times every 8th, with the dt of the frames
+ * since the particle's last update. Positions and lifetimes still advance
+ * every frame
+ * \param near distance from which forces are updated less often, 0 updates
+ * them every frame
+ */
+void ParticleSystem::SetLODDistance(const float near) {
+    lod_near = near;
+}
+
+/**
+ * \return distance from which forces are updated less often, 0 if always
+ */
+float ParticleSystem::GetLODDistance() const {
+    return lod_near;
+}
 
-    prog.Uniform("max_particles", max);
-    prog.Uniform("dt", dt);
-    prog.Uniform("spawn_time", spawn_time);
-    prog.Uniform("own_spawner", own_spawner);
-    prog.Uniform("particle_life", particle_life);
-    prog.Uniform("spawner_mass", mass, spawner_len, 1);
-    prog.Uniform("spawner_pos", (const float*)pos, spawner_len, 3);
+/**
+ * \brief Only particles whose billboard touches the view frustum are
+ * written to the draw snapshot, on by default
+ */
+void ParticleSystem::SetCulling(const bool enable) {
+    culling = enable;
+}
 
-    prog.Dispatch({max/255 + 1, 1, 1});
+/**
+ * \brief Reorders the pool along a Morton curve every interval frames, so
+ * particles close in space are simulated and drawn from close memory
+ * \param interval frames between reorders, 0 never reorders
+ */
+void ParticleSystem::SetReorderInterval(const GLuint interval) {
+    reorder_interval = interval;
+    frames_since_reorder = 0;
+    if (interval && !sort_prog)
+        sort_prog = make_unique<Program>(
+            vector<GLuint>{12}, vector<GLuint>{GL_COMPUTE_SHADER},
+            LayoutDefines(layout) + "#define MORTON_BITS " +
+            to_string(PARTICLE_SORT_BITS) + "\n");
+}
+
+/**
+ * \brief Copies a stream of the pool into its spare buffer in Morton
+ * order, then swaps the two. The sort order has to be bound
+ * \param id stream to permute
+ * \param stride bytes per particle
+ */
+void ParticleSystem::Permute(const GLuint id, const GLsizeiptr stride) {
+    // Allocated by the first reorder after every growth, then reused
+    if (!sort_spare[id]) {
+        glGenBuffers(1, &sort_spare[id]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sort_spare[id]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * stride, nullptr,
+                     GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PERMUTE_SRC_BINDING, ssbo[id]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PERMUTE_DST_BINDING,
+                     sort_spare[id]);
+    sort_prog->Uniform("words", (GLuint)(stride / sizeof(GLuint)));
+    Program::DispatchIndirect(offsetof(IndirectCmd, dispatch_x));
+    swap(ssbo[id], sort_spare[id]);
+}
+
+/**
+ * \brief Sorts the live particles by the Morton cell of their position.
+ * A counting sort over the cells gives the order, then every stream is
+ * gathered into its spare buffer and the two swap. Afterwards the live
+ * particles fill the first slots in the order of the alive list, the free
+ * stack is empty and every slot past them counts as never used.
+ * The scatter hands out the indices within a cell with atomics, so the
+ * order of a cell's particles, and with it their slots, may differ from
+ * run to run. Needs the alive list of the last simulation, keeps one
+ * extra copy of the pool streams. The draw snapshot has no order, so it
+ * stays as it is. Update runs it before the simulation, so the visible
+ * slots the draw reads stay valid. Only adds its passes to the graph of
+ * Update, the scratch is transient
+ */
+void ParticleSystem::Reorder() {
+    const GLuint particles = graph.Import("particles", GRAPH_RESOURCE_BUFFER);
+    const GLuint free_list = graph.Import("free_list", GRAPH_RESOURCE_BUFFER);
+    const GLuint alive = graph.Import("alive", GRAPH_RESOURCE_BUFFER);
+    const GLuint draw_cmd = graph.Import("draw_cmd", GRAPH_RESOURCE_BUFFER);
+    const GLuint keys = graph.CreateBuffer("sort_keys",
+                                           capacity * sizeof(GLuint));
+    const GLuint buckets = graph.CreateBuffer("sort_buckets",
+        (GLsizeiptr(1) << (3*PARTICLE_SORT_BITS)) * sizeof(GLuint));
+    const GLuint order = graph.CreateBuffer("sort_order",
+                                            capacity * sizeof(GLuint));
+
+    // Binds everything a stage may touch, the scratch only lives in the
+    // passes
+    const auto use_stage = [this, keys, buckets, order](const GLuint stage) {
+        BindSSBOs();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SORT_KEY_BINDING,
+                         graph.GetHandle(keys));
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SORT_BUCKET_BINDING,
+                         graph.GetHandle(buckets));
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SORT_ORDER_BINDING,
+                         graph.GetHandle(order));
+        const vec3 sort_min(-PARTICLE_SORT_EXTENT/2);
+        sort_prog->Use();
+        sort_prog->Uniform("sort_min", &sort_min.x, 1, 3);
+        sort_prog->Uniform("sort_scale",
+                           (1 << PARTICLE_SORT_BITS)/PARTICLE_SORT_EXTENT);
+        sort_prog->Uniform("stage", stage);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, ssbo[SSBO_DRAWCMD]);
+    };
+
+    graph.AddPass("sort_clear", {GraphWrite(buckets, GRAPH_ACCESS_TRANSFER)},
+                  [this, buckets]() {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, graph.GetHandle(buckets));
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+                          GL_UNSIGNED_INT, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    });
+    graph.AddPass("sort_keys", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphRead(draw_cmd, GRAPH_ACCESS_SSBO),
+        GraphRead(particles, GRAPH_ACCESS_SSBO),
+        GraphRead(alive, GRAPH_ACCESS_SSBO),
+        GraphWrite(keys, GRAPH_ACCESS_SSBO),
+        GraphWrite(buckets, GRAPH_ACCESS_SSBO),
+    }, [this, use_stage]() {
+        // The clear depends on nothing and may run much earlier, the zone
+        // spans the passes that follow the simulation
+        reorder_zone = make_unique<GpuZone>("reorder");
+        use_stage(SORT_STAGE_KEYS);
+        Program::DispatchIndirect(offsetof(IndirectCmd, dispatch_x));
+    });
+    graph.AddPass("sort_scan", {GraphWrite(buckets, GRAPH_ACCESS_SSBO)},
+                  [use_stage]() {
+        use_stage(SORT_STAGE_SCAN);
+        Program::Dispatch({1, 1, 1});
+    });
+    graph.AddPass("sort_scatter", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphRead(draw_cmd, GRAPH_ACCESS_SSBO),
+        GraphRead(keys, GRAPH_ACCESS_SSBO),
+        GraphWrite(buckets, GRAPH_ACCESS_SSBO),
+        GraphWrite(order, GRAPH_ACCESS_SSBO),
+    }, [use_stage]() {
+        use_stage(SORT_STAGE_SCATTER);
+        Program::DispatchIndirect(offsetof(IndirectCmd, dispatch_x));
+    });
+
+    // Every gather reads the old alive list, so it's rewritten last
+    graph.AddPass("sort_permute", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphRead(draw_cmd, GRAPH_ACCESS_SSBO),
+        GraphRead(alive, GRAPH_ACCESS_SSBO),
+        GraphRead(order, GRAPH_ACCESS_SSBO),
+        GraphWrite(particles, GRAPH_ACCESS_SSBO),
+    }, [this, use_stage]() {
+        use_stage(SORT_STAGE_PERMUTE);
+        for (GLuint i = 0; i < size(particle_streams); ++i) {
+            const GLsizeiptr stride = particle_strides[layout][i];
+            if (!stride)
+                continue;
+            Permute(particle_streams[i], stride);
+        }
+    });
+    graph.AddPass("sort_reset", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphRead(draw_cmd, GRAPH_ACCESS_SSBO),
+        GraphWrite(free_list, GRAPH_ACCESS_SSBO),
+        GraphWrite(alive, GRAPH_ACCESS_SSBO),
+    }, [this, use_stage]() {
+        use_stage(SORT_STAGE_RESET);
+        Program::DispatchIndirect(offsetof(IndirectCmd, dispatch_x));
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+        reorder_zone.reset();
+    });
 }
 
 void ParticleSystem::Draw() {
-    mesh->UpdateProjection();
-    BindSSBOBase(SSBO_PARTICLE);
+    // No barrier if a graph of the caller already made the snapshot visible
+    vector<GraphUse> uses = {
+        GraphRead(ImportSnapshot(), GRAPH_ACCESS_SSBO),
+        GraphRead(graph.Import("draw_args", GRAPH_RESOURCE_BUFFER),
+                  GRAPH_ACCESS_INDIRECT),
+    };
+    if (!pipelined)
+        uses.push_back(GraphRead(graph.Import("particles",
+                                              GRAPH_RESOURCE_BUFFER),
+                                 GRAPH_ACCESS_SSBO));
+    graph.AddPass("draw", uses, [this]() { DrawSnapshot(); });
+    graph.Execute();
+}
+
+void ParticleSystem::DrawSnapshot() const {
+    if (draw_mode == PARTICLE_DRAW_MESH)
+        mesh->Bind();
+    else
+        glBindVertexArray(pull_vao);
+    if (draw_prog)
+        draw_prog->Use();
+    BindSSBOs();
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_args[cur]);
+    // The arrays command is the first four words of the elements one
+    if (draw_mode != PARTICLE_DRAW_MESH)
+        glDrawArraysIndirect(GL_TRIANGLES, nullptr);
+    else
+        glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr);
+}
+
+/**
+ * \return graph resource of what the simulation writes for the draw of
+ * this frame, the half of the snapshot or the visible slots
+ */
+GLuint ParticleSystem::ImportSnapshot() {
+    return graph.Import(pipelined ? "snapshot" + to_string(cur) : "visible",
+                        GRAPH_RESOURCE_BUFFER);
+}
+
+/**
+ * \brief Allocates what the simulation writes for the draw, rewritten by
+ * every update so nothing is kept. Two vec4 snapshots cost 32 bytes per
+ * slot, the visible slots 4
+ * \param slots capacity of the pool
+ */
+void ParticleSystem::AllocSnapshot(const GLuint slots) {
+    glDeleteBuffers(2, instances);
+    glDeleteBuffers(1, &visible_buf);
+    fill(begin(instances), end(instances), 0);
+    visible_buf = 0;
+    if (pipelined) {
+        glGenBuffers(2, instances);
+        for (GLuint i = 0; i < 2; ++i) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, instances[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, slots * sizeof(vec4),
+                         nullptr, GL_DYNAMIC_COPY);
+        }
+    } else {
+        glGenBuffers(1, &visible_buf);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, visible_buf);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, slots * sizeof(GLuint),
+                     nullptr, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/**
+ * \brief Builds the draw program for the draw mode, unless the program of
+ * the mesh does. Without the snapshot it decodes the pool's layout
+ */
+void ParticleSystem::MakeDrawProgram() {
+    string defines;
+    if (draw_mode != PARTICLE_DRAW_MESH)
+        defines += "#define PARTICLE_PULL\n";
+    if (draw_mode == PARTICLE_DRAW_PULL_TRIANGLE)
+        defines += "#define PARTICLE_PULL_TRIANGLE\n";
+    if (!pipelined)
+        defines += LayoutDefines(layout) + "#define PARTICLE_FROM_POOL\n";
+    draw_prog.reset();
+    if (!defines.empty())
+        draw_prog = make_unique<Program>(
+            vector<GLuint>{5, 7},
+            vector<GLuint>{GL_VERTEX_SHADER, GL_FRAGMENT_SHADER}, defines);
+}
+
+/**
+ * \brief Double buffers a snapshot of the visible particles, so the next
+ * frame's simulation writes nothing the draw of this one reads and
+ * drivers may overlap them. Costs 32 bytes per slot on top of the layout.
+ * Off by default, the draw then decodes the visible slots of the pool
+ * for 4 bytes per slot
+ */
+void ParticleSystem::SetPipelining(const bool enable) {
+    if (enable == pipelined)
+        return;
+    pipelined = enable;
+    AllocSnapshot(capacity);
+    MakeDrawProgram();
+}
+
+/**
+ * \brief Picks how billboards are drawn. The pulling modes make the
+ * corners in particles.vert from gl_VertexID with no vertex or index
+ * buffer, offset in view space from the view projection of the frame
+ */
+void ParticleSystem::SetDrawMode(const ParticleDraw mode) {
+    draw_mode = mode;
+    // Core profiles draw nothing without a vertex array
+    if (mode != PARTICLE_DRAW_MESH && !pull_vao)
+        glGenVertexArrays(1, &pull_vao);
+    const GLuint count = mode == PARTICLE_DRAW_PULL_TRIANGLE ? 3 : 6;
+    MakeDrawProgram();
+    // Only the instance count is rewritten by the simulation
     glBindBuffer(GL_DRAW_INDIRECT_BUFFER, ssbo[SSBO_DRAWCMD]);
-    glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER,
+                    offsetof(IndirectCmd, visible) + offsetof(DrawCmd, count),
+                    sizeof(GLuint), &count);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+/**
+ * \return graph of Update and Draw, passes added to it before Update run
+ * with the passes of Update
+ */
+RenderGraph *ParticleSystem::GetGraph() {
+    return &graph;
 }
 
 void ParticleSystem::BindSSBOBase(const GLuint id) const {
@@ -405,8 +1803,44 @@ void ParticleSystem::BindSSBOBase(const GLuint id) const {
                      ssbo[id]);
 }
 
+/**
+ * \brief Binds every buffer the layout uses to its binding point
+ */
+void ParticleSystem::BindSSBOs() const {
+    for (GLuint i = 0; i < SSBO_NUM; ++i)
+        BindSSBOBase(i);
+    if (ring)
+        ring->Bind(GL_SHADER_STORAGE_BUFFER, FRAME_BINDING, frame_size_used);
+    if (spawner_state)
+        spawner_state->Bind();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_BINDING,
+                     instances[cur]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_BINDING, visible_buf);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BOUNDS_BINDING, bounds_buf);
+    for (GLuint i = 0; i < size(particle_streams); ++i)
+        if (!particle_strides[layout][i])
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER,
+                             particle_streams[i], 0);
+}
+
+/**
+ * \return the shader defines selecting the particle layout
+ */
+string ParticleSystem::LayoutDefines(const ParticleLayout layout) {
+    switch (layout) {
+        case PARTICLE_LAYOUT_SOA:
+            return "#define PARTICLE_SOA\n";
+        case PARTICLE_LAYOUT_COMPACT:
+            return "#define PARTICLE_COMPACT\n";
+        default:
+            return "";
+    }
+}
+
 template<typename T>
 T *const ParticleSystem::MapSSBO(GLuint ind) const {
+    // Stalls anyway, so don't track what the graph left unsynchronized
+    Program::FinishComputes(GL_BUFFER_UPDATE_BARRIER_BIT);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo[ind]);
     return (T*)glMapBuffer(
                 GL_SHADER_STORAGE_BUFFER,
@@ -414,28 +1848,140 @@ T *const ParticleSystem::MapSSBO(GLuint ind) const {
             );
 }
 
-void ParticleSystem::PrintParticles() {
+/**
+ * \brief Reads back the length of the alive list.
+ * Stalls until all submitted computes finish, so don't call it per frame
+ */
+GLuint ParticleSystem::CountAlive() const {
+    DrawCmd *const cmd = MapSSBO<DrawCmd>(SSBO_DRAWCMD);
+    const GLuint alive = cmd->instanceCount;
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return alive;
+}
+
+/**
+ * \brief Counts the live particles of every spawner from a read back of the
+ * alive list. Stalls like CountAlive
+ */
+vector<GLuint> ParticleSystem::CountAliveBySpawner(
+        const GLuint spawner_len) const {
+    vector<GLuint> counts(spawner_len, 0);
+    const GLuint alive_num = CountAlive();
+    const vector<Particle> particles = ReadParticles(CountSlots());
+
+    const GLuint *const alive = MapSSBO<GLuint>(SSBO_ALIVE);
+    for (GLuint i = 0; i < alive_num; ++i) {
+        const GLuint spawner = particles[alive[i]].spawner;
+        if (spawner < spawner_len)
+            ++counts[spawner];
+    }
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return counts;
+}
+
+/**
+ * \return slots allocated so far, at most the pool size
+ */
+GLuint ParticleSystem::GetCapacity() const {
+    return capacity;
+}
+
+/**
+ * \return number of slots ever handed out, live or on the free list.
+ * Stalls like CountAlive
+ */
+GLuint ParticleSystem::CountSlots() const {
+    FreeList *const free_list = MapSSBO<FreeList>(SSBO_DEADINDS);
+    const GLuint slots = glm::min(free_list->slot_count, capacity);
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return slots;
+}
+
+/**
+ * \brief Reads back the first slots of the pool whatever the layout
+ * \param count number of slots to read
+ */
+vector<Particle> ParticleSystem::ReadParticles(GLuint count) const {
+    count = glm::min(count, capacity);
+    vector<Particle> particles(count);
+    if (layout == PARTICLE_LAYOUT_AOS) {
+        const Particle *const src = MapSSBO<Particle>(SSBO_PARTICLE);
+        copy(src, src + count, particles.begin());
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    }
+    else if (layout == PARTICLE_LAYOUT_COMPACT) {
+        const PackedParticle *const src =
+            MapSSBO<PackedParticle>(SSBO_PARTICLE);
+        for (GLuint i = 0; i < count; ++i) {
+            const vec2 vel_xy = unpackHalf2x16(src[i].vel_xy);
+            const vec2 vel_z_mass = unpackHalf2x16(src[i].vel_z_mass);
+            const vec2 scale_life = unpackUnorm2x16(src[i].scale_life) *
+                vec2(PACKED_SCALE_MAX, PACKED_LIFE_MAX);
+            particles[i].pos = src[i].pos;
+            particles[i].vel = vec3(vel_xy.x, vel_xy.y, vel_z_mass.x);
+            particles[i].mass = vel_z_mass.y;
+            particles[i].scale = scale_life.x;
+            particles[i].life = scale_life.y;
+            particles[i].spawner = src[i].spawner & SPAWNER_MASK;
+        }
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    }
+    else {
+        const vec4 *const pos_life = MapSSBO<vec4>(SSBO_PARTICLE);
+        for (GLuint i = 0; i < count; ++i) {
+            particles[i].pos = vec3(pos_life[i]);
+            particles[i].life = pos_life[i].w;
+        }
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+        const vec4 *const vel_mass = MapSSBO<vec4>(SSBO_PARTICLE_VEL);
+        for (GLuint i = 0; i < count; ++i) {
+            particles[i].vel = vec3(vel_mass[i]);
+            particles[i].mass = vel_mass[i].w;
+        }
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+        const float *const scale = MapSSBO<float>(SSBO_PARTICLE_SCALE);
+        for (GLuint i = 0; i < count; ++i)
+            particles[i].scale = scale[i];
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+        const GLuint *const spawner = MapSSBO<GLuint>(SSBO_PARTICLE_SPAWNER);
+        for (GLuint i = 0; i < count; ++i)
+            particles[i].spawner = spawner[i] & SPAWNER_MASK;
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return particles;
+}
+
+void ParticleSystem::PrintParticles() const {
     prog.Use();
-    INF("Particle Buf={}; DrawCmd Buf={}; Dead Indices Buf={}",
+    INF("Particle Buf={}; DrawCmd Buf={}; Free List Buf={}",
             ssbo[SSBO_PARTICLE],
             ssbo[SSBO_DRAWCMD],
             ssbo[SSBO_DEADINDS]);
 
-    DrawCmd *const cmd = MapSSBO<DrawCmd>(SSBO_DRAWCMD);
-    GLuint count = cmd->instanceCount;
-    INF("Printing {} particles\n", count);
+    FreeList *const free_list = MapSSBO<FreeList>(SSBO_DEADINDS);
+    const GLuint *const free_inds = (GLuint*)(free_list + 1);
+    print("free indices =\n[");
+    for (GLuint i = 0; i < free_list->count; ++i)
+        print("{}, ", free_inds[i]);
+    print("\b\b]\n");
     glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    GLint *const is_ind_dead = MapSSBO<GLint>(SSBO_DEADINDS);
-    println("last spawn time = {}", *(float*)is_ind_dead);
-    print("dead indices =\n[");
-    for (GLuint i = 1; i < max + 1; ++i)
-        print("{}, ", is_ind_dead[i]);
-    print("\b\b]\n");
+    ParticlePool::PrintParticles();
+}
 
-    Particle *const particles = MapSSBO<Particle>(SSBO_PARTICLE);
-    for (GLuint i = 0; i < 100; ++i) {
-        println("[{}]:pos=({},{},{}), vel=({},{},{}), mass={}, life={}, scale={}",
+void ParticlePool::PrintParticles() const {
+    INF("Printing {} particles\n", CountAlive());
+    const vector<Particle> particles = ReadParticles(100);
+    for (GLuint i = 0; i < particles.size(); ++i) {
+        println("[{}]:pos=({},{},{}), vel=({},{},{}), mass={}, life={}, scale={}, spawner={}",
                 i,
 
                 particles[i].pos.x,
@@ -448,10 +1994,9 @@ void ParticleSystem::PrintParticles() {
 
                 particles[i].mass,
                 particles[i].life,
-                particles[i].scale
+                particles[i].scale,
+                particles[i].spawner
             );
     }
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     fflush(stdout);
 }
@@ -3,9 +3,13 @@
 #include "glm/ext/vector_float3.hpp"
 #include "glm/ext/vector_float2.hpp"
 #include "glm/ext/vector_int3.hpp"
+#include "profiler.hpp"
+#include "render_graph.hpp"
 #include <GL/gl.h>
 #include <GL/glext.h>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -57,24 +61,102 @@ private:
 
 class Program {
 public:
-    Program(vector<GLuint>, vector<GLuint>);
-    Program(const Program &);
-    ~Program();
+    /**
+    * \brief Compiles and links shaders from the embedded sources. Identical
+    * programs are shared within the process and linked binaries are cached
+    * on disk, so only a cache miss compiles GLSL
+    * \param ids indices into the embedded shader sources
+    * \param types shader type of every source
+    * \param defines inserted right after the #version line
+    */
+    Program(vector<GLuint>, vector<GLuint>, const string & = "");
     void Use() const;
     static void Dispatch(const vector<Texture*>, const ivec3);
     static void Dispatch(const ivec3);
-    static void FinishComputes(const GLuint =
-                               GL_SHADER_IMAGE_ACCESS_BARRIER_BIT|
-                               GL_SHADER_STORAGE_BARRIER_BIT|
-                               GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    static void DispatchIndirect(const GLintptr);
+    static void FinishComputes(const GLuint);
     GLuint GetUniformLoc(const char *const) const;
     void Uniform(const char *, GLuint) const;
     void Uniform(const char *, GLint) const;
     void Uniform(const char *, float) const;
     void Uniform(const char *, const float *, GLint, GLint) const;
+    void Uniform(const char *, const GLuint *, GLint) const;
     void Uniform(const char *, const mat4) const;
 private:
+    // Copies share the GL program, it is deleted with the last of them
+    shared_ptr<const GLuint> handle;
     GLuint program;
+    mutable unordered_map<string, GLint> uniform_locs;
+};
+
+/**
+* \brief Persistently mapped buffer split into regions that are reused in
+* turn, every region is guarded by a fence so the CPU never writes data the
+* GPU is still reading
+*/
+class FrameRing {
+public:
+    FrameRing(const GLsizeiptr, const GLuint = 3);
+    FrameRing(const FrameRing &) = delete;
+    ~FrameRing();
+    char *Next();
+    void Bind(const GLenum, const GLuint, const GLsizeiptr) const;
+    GLsizeiptr GetSize() const;
+private:
+    GLuint buf;
+    char *data;
+    GLsizeiptr region;
+    GLuint cur = 0;
+    vector<GLsync> fences;
+};
+
+/**
+* \brief Copies part of a buffer into client memory that stays mapped and
+* hands it out once the GPU got there, so reading GPU results never stalls
+*/
+class BufferReadback {
+public:
+    BufferReadback(const GLsizeiptr);
+    BufferReadback(const BufferReadback &) = delete;
+    ~BufferReadback();
+    void Request(const GLuint, const GLintptr, const GLsizeiptr);
+    const void *Poll();
+private:
+    GLuint buf;
+    const char *data;
+    GLsync fence = nullptr;
+    GLsizeiptr size;
+};
+
+/**
+* \brief Spawner positions, velocities and masses kept on the GPU and
+* stepped by spawner.comp, so the particle passes read them in place. The
+* CPU only gets a copy back when it asks for one, without stalling
+*/
+class SpawnerState {
+public:
+    /**
+    * \brief Uploads the initial state of every spawner
+    * \param pos, vel, mass initial state
+    * \param num number of spawners
+    * \param defines physics constants of spawner.comp
+    */
+    SpawnerState(const vec3 *, const vec3 *, const float *, const GLuint,
+                 const string &);
+    SpawnerState(const SpawnerState &) = delete;
+    ~SpawnerState();
+    void Update(const float, RenderGraph *);
+    void Bind() const;
+    void RequestReadback(RenderGraph *);
+    bool PollReadback(vec3 *, vec3 *);
+    GLuint GetCount() const;
+private:
+    Program prog;
+    GLuint buf;
+    GLuint num;
+    BufferReadback readback;
+    // From RequestReadback until PollReadback hands the copy out
+    bool readback_pending = false;
 };
 
 class Vertex {
@@ -83,6 +165,15 @@ public:
     vec2 uv;
 };
 
+// INFO: command of glDrawElementsIndirect
+struct DrawCmd {
+    GLuint  count;
+    GLuint  instanceCount;
+    GLuint  firstIndex;
+    GLint   baseVertex;
+    GLuint  baseInstance;
+};
+
 class Mesh {
 public:
     shared_ptr<Program> program;
@@ -96,6 +187,8 @@ public:
             const shared_ptr<Program>);
     Mesh(const Mesh &) = default;
     ~Mesh();
+    void Bind() const;
+    mat4 GetTransform() const;
     void UpdateProjection() const;
     void Draw() const ;
     GLuint GetElemCnt() const;
@@ -103,22 +196,57 @@ private:
     GLuint elem_cnt;
 };
 
-class ParticleSystem {
+/**
+* \brief Static meshes sharing a fragment shader, drawn with a single
+* glMultiDrawElementsIndirect. Their vertices and indices live in one
+* buffer and batch.vert reads the offset of every draw by gl_DrawID
+*/
+class MeshBatch {
 public:
-    ParticleSystem(unique_ptr<Mesh>, const GLuint);
-    ~ParticleSystem();
-    void Update(const float, const vec3 *, const float *, const vec3 *,
-                const GLuint, const GLuint, const float, const float);
+    MeshBatch(const GLuint);
+    MeshBatch(const MeshBatch &) = delete;
+    ~MeshBatch();
+    GLuint Add(const vector<Vertex> &, const vector<GLuint> &,
+               const vec3 = vec3(0));
     void Draw();
-    void PrintParticles();
 private:
-    void BindSSBOBase(const GLuint) const;
-    template<typename T> T *const MapSSBO(GLuint) const;
+    void Upload();
 private:
-    unique_ptr<Mesh> mesh;
+    // Without GL_ARB_shader_draw_parameters the draws are issued one by one
+    bool draw_id;
     Program prog;
-    GLuint ssbo[3];
-    GLuint max;
+    GLuint vao;
+    GLuint vbo;
+    GLuint ebo;
+    GLuint cmds;
+    // Translation of every draw
+    GLuint offset_buf;
+    vector<Vertex> verts;
+    vector<GLuint> elems;
+    vector<DrawCmd> draw_cmds;
+    vector<vec3> positions;
+    bool dirty = false;
+};
+
+enum {
+    SSBO_PARTICLE,
+    SSBO_DRAWCMD,
+    SSBO_DEADINDS,
+    SSBO_ALIVE,
+    SSBO_ALIVE_NEXT,
+    SSBO_PARTICLE_VEL,
+    SSBO_PARTICLE_SCALE,
+    SSBO_PARTICLE_SPAWNER,
+    SSBO_NUM
+};
+
+// INFO: SoA splits particles into pos/life, vel/mass and scale streams,
+// compact quantizes everything but the position to 16 bits
+enum ParticleLayout {
+    PARTICLE_LAYOUT_AOS,
+    PARTICLE_LAYOUT_SOA,
+    PARTICLE_LAYOUT_COMPACT,
+    PARTICLE_LAYOUT_NUM
 };
 
 // INFO: _pN are padding as according to glsl std430
@@ -130,6 +258,172 @@ public:
     float mass;
     float life;
     float scale;
-    float _p3;
-    float _p4;
+    GLuint spawner;
+    // Frames since the last force update of the temporal LOD, GPU only
+    GLuint lod_wait;
+};
+
+// INFO: how particle.comp reserves alive list and free stack entries, one
+// atomic per invocation, per workgroup or per subgroup
+enum ParticleAtomics {
+    PARTICLE_ATOMICS_AUTO,
+    PARTICLE_ATOMICS_GLOBAL,
+    PARTICLE_ATOMICS_WORKGROUP,
+    PARTICLE_ATOMICS_SUBGROUP,
+    PARTICLE_ATOMICS_NUM
+};
+
+// INFO: where the particles of one spawner were a few frames ago, all zero
+// without any
+struct CloudBounds {
+public:
+    vec3 min;
+    vec3 max;
+    vec3 centroid;
+    GLuint count;
+};
+
+struct CloudBoundsGPU;
+
+// INFO: how billboards are drawn, instanced from the quad Mesh or pulled
+// from gl_VertexID as a 6 vertex quad or one triangle around it
+enum ParticleDraw {
+    PARTICLE_DRAW_MESH,
+    PARTICLE_DRAW_PULL_QUAD,
+    PARTICLE_DRAW_PULL_TRIANGLE,
+    PARTICLE_DRAW_NUM
+};
+
+enum ParticleBackend {
+    PARTICLE_BACKEND_GPU,
+    PARTICLE_BACKEND_CPU,
+    PARTICLE_BACKEND_NUM
+};
+
+/**
+* \brief Simulation interface every particle backend implements, so the
+* spawners can pick one at runtime
+*/
+class ParticlePool {
+public:
+    virtual ~ParticlePool() = default;
+    /**
+    * \brief Emits, simulates and retires the particles of one frame
+    * \param dt timestep
+    * \param pos, mass, vel state of every spawner
+    * \param spawner_len number of spawners
+    * \param spawn_ends inclusive prefix sum of every spawner's spawns this
+    * frame, as ParticleBudget schedules them
+    * \param life lifetime of new particles
+    */
+    virtual void Update(const float, const vec3 *, const float *,
+                        const vec3 *, const GLuint, const GLuint *,
+                        const float) = 0;
+    // Backends without a GPU copy of the pool draw nothing
+    virtual void Draw() {}
+    virtual GLuint CountAlive() const = 0;
+    virtual vector<GLuint> CountAliveBySpawner(const GLuint) const = 0;
+    virtual GLuint CountSlots() const = 0;
+    // Slots currently allocated, up to the pool size
+    virtual GLuint GetCapacity() const = 0;
+    virtual vector<Particle> ReadParticles(GLuint) const = 0;
+    virtual void PrintParticles() const;
+};
+
+class ParticleSystem : public ParticlePool {
+public:
+    /**
+    * \param max pool size the pool never grows past
+    * \param spawner_state read the spawners from it instead of the
+    * positions passed to Update, may be null
+    * \param initial slots allocated up front, the pool doubles from there
+    * as the live count demands. 0 allocates max right away
+    * \param atomics aggregation of the counters, see PickAtomics
+    */
+    ParticleSystem(unique_ptr<Mesh>, const GLuint,
+                   const ParticleLayout = PARTICLE_LAYOUT_AOS,
+                   const SpawnerState * = nullptr, const GLuint = 0,
+                   const ParticleAtomics = PARTICLE_ATOMICS_AUTO);
+    ~ParticleSystem();
+    void Update(const float, const vec3 *, const float *, const vec3 *,
+                const GLuint, const GLuint *, const float) override;
+    void Draw() override;
+    GLuint CountAlive() const override;
+    vector<GLuint> CountAliveBySpawner(const GLuint) const override;
+    GLuint CountSlots() const override;
+    GLuint GetCapacity() const override;
+    vector<Particle> ReadParticles(GLuint) const override;
+    void PrintParticles() const override;
+    void SetReorderInterval(const GLuint);
+    void SetLODDistance(const float);
+    float GetLODDistance() const;
+    void SetCulling(const bool);
+    void SetBoundsReadback(const bool);
+    const vector<CloudBounds> &GetBounds() const;
+    bool IsAnyCloudVisible() const;
+    void SetDrawMode(const ParticleDraw);
+    void SetPipelining(const bool);
+    RenderGraph *GetGraph();
+    static string LayoutDefines(const ParticleLayout);
+    static ParticleAtomics PickAtomics(const ParticleAtomics);
+private:
+    void Reorder();
+    void DrawSnapshot() const;
+    GLuint ImportSnapshot();
+    void AllocSnapshot(const GLuint);
+    void MakeDrawProgram();
+    void ReadBounds(const CloudBoundsGPU *);
+    void Permute(const GLuint, const GLsizeiptr);
+    void Grow(const GLuint);
+    void ResizeSSBO(const GLuint, const GLsizeiptr, const GLsizeiptr);
+    void BindSSBOBase(const GLuint) const;
+    void BindSSBOs() const;
+    template<typename T> T *const MapSSBO(GLuint) const;
+private:
+    unique_ptr<Mesh> mesh;
+    Program prog;
+    unique_ptr<FrameRing> ring;
+    const SpawnerState *spawner_state;
+    GLuint ssbo[SSBO_NUM];
+    // Draw snapshot and indirect draw of the visible particles of the last
+    // two frames, cur is the one the last Update wrote. Without pipelining
+    // there is no snapshot, the draw decodes the visible slots of the pool
+    bool pipelined = false;
+    GLuint instances[2] = {};
+    GLuint visible_buf = 0;
+    GLuint draw_args[2];
+    GLuint cur = 0;
+    GLuint max;
+    GLuint capacity;
+    ParticleLayout layout;
+    // Live count of a recent frame, sizes the growth
+    BufferReadback live_readback;
+    GLuint last_spawn_count = 0;
+    GLsizeiptr frame_size_used = 0;
+    // Morton reorder of the pool, see particle_sort.comp
+    unique_ptr<Program> sort_prog;
+    GLuint reorder_interval = 0;
+    GLuint frames_since_reorder = 0;
+    // Second buffer of every stream the reorder gathers into, 0 until used
+    GLuint sort_spare[SSBO_NUM] = {};
+    // Temporal LOD, see SetLODDistance
+    float lod_near = 0;
+    GLuint frame = 0;
+    // dt of the last LOD_WAIT_FRAMES frames, newest first
+    float lod_dts[16] = {};
+    bool culling = true;
+    // Bounds of every spawner's cloud, see SetBoundsReadback
+    bool bounds_enabled = false;
+    GLuint bounds_buf = 0;
+    GLuint bounds_num = 0;
+    unique_ptr<BufferReadback> bounds_readback;
+    vector<CloudBounds> bounds;
+    // Vertex pulling, see SetDrawMode. The draw uses the program of the
+    // mesh unless it pulls or reads the pool
+    ParticleDraw draw_mode = PARTICLE_DRAW_MESH;
+    unique_ptr<Program> draw_prog;
+    GLuint pull_vao = 0;
+    // Orders the passes of Update and Draw, see RenderGraph
+    RenderGraph graph;
+    unique_ptr<GpuZone> reorder_zone;
 };
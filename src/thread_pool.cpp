@@ -0,0 +1,116 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    if (threads == 0)
+        threads = max(thread::hardware_concurrency(), 1u);
+    // Queue 0 belongs to the thread calling ParallelFor
+    for (unsigned int i = 0; i < threads; ++i)
+        queues.push_back(make_unique<Queue>());
+    for (unsigned int i = 1; i < threads; ++i)
+        workers.emplace_back(&ThreadPool::Work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> guard(sleep_lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (thread &worker: workers)
+        worker.join();
+}
+
+/**
+ * \brief Runs one task, from the own queue first, then stolen
+ * \return false if every queue was empty
+ */
+bool ThreadPool::RunOne(const unsigned int self) {
+    function<void()> task;
+    for (unsigned int i = 0; i < queues.size() && !task; ++i) {
+        Queue &q = *queues[(self + i) % queues.size()];
+        lock_guard<mutex> guard(q.lock);
+        if (q.tasks.empty())
+            continue;
+        if (i == 0) {
+            task = move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        else {
+            task = move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+    if (!task)
+        return false;
+    --queued;
+    task();
+    return true;
+}
+
+void ThreadPool::Work(const unsigned int self) {
+    while (true) {
+        if (RunOne(self))
+            continue;
+        unique_lock<mutex> guard(sleep_lock);
+        wake.wait(guard, [this] { return stop || queued > 0; });
+        if (stop)
+            return;
+    }
+}
+
+void ThreadPool::ParallelFor(const size_t n, size_t grain,
+                             const function<void(size_t, size_t)> &func) {
+    grain = max<size_t>(grain, 1);
+    const size_t chunks = (n + grain - 1) / grain;
+    // Callers may keep per chunk state, so chunks stay chunks here too
+    if (chunks <= 1 || queues.size() == 1) {
+        for (size_t begin = 0; begin < n; begin += grain)
+            func(begin, min(begin + grain, n));
+        return;
+    }
+
+    atomic<size_t> left = chunks;
+    {
+        lock_guard<mutex> guard(sleep_lock);
+        queued += chunks;
+    }
+    // Deal the chunks out in blocks so neighbours stay on one thread until
+    // someone has to steal
+    const size_t per_queue = (chunks + queues.size() - 1) / queues.size();
+    for (size_t c = 0; c < chunks; ++c) {
+        const size_t begin = c * grain;
+        const size_t end = min(begin + grain, n);
+        Queue &q = *queues[c / per_queue];
+        lock_guard<mutex> guard(q.lock);
+        q.tasks.push_back([this, &func, &left, begin, end] {
+            func(begin, end);
+            if (--left == 0) {
+                lock_guard<mutex> guard(sleep_lock);
+                finished.notify_all();
+            }
+        });
+    }
+    wake.notify_all();
+
+    // Help until nothing is left to steal, then sleep until the chunks
+    // still running are done
+    while (left > 0) {
+        if (RunOne(0))
+            continue;
+        unique_lock<mutex> guard(sleep_lock);
+        finished.wait(guard, [&left] { return left == 0; });
+    }
+}
+
+unsigned int ThreadPool::GetThreads() const {
+    return queues.size();
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+* \brief Fixed set of workers with one task queue each. A worker pops the
+* newest task of its own queue and steals the oldest one of another queue
+* when it runs dry, so uneven chunks still keep every thread busy
+*/
+class ThreadPool {
+public:
+    /**
+    * \param threads workers including the caller, 0 picks the core count
+    */
+    ThreadPool(unsigned int = 0);
+    ThreadPool(const ThreadPool &) = delete;
+    ~ThreadPool();
+    /**
+    * \brief Runs func(begin, end) over [0, n) in chunks of grain and
+    * returns once all of them are done. The caller works too
+    */
+    void ParallelFor(const size_t, const size_t,
+                     const function<void(size_t, size_t)> &);
+    unsigned int GetThreads() const;
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+    bool RunOne(const unsigned int);
+    void Work(const unsigned int);
+private:
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> workers;
+    mutex sleep_lock;
+    condition_variable wake;
+    // Signals ParallelFor that its last chunk is done
+    condition_variable finished;
+    atomic<size_t> queued = 0;
+    bool stop = false;
+};
@@ -0,0 +1,91 @@
+#include "nbody.hpp"
+#include "thread_pool.hpp"
+#include "logger.hpp"
+#include "glm/ext/vector_float3.hpp"
+#include <GL/gl.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Max force error of Barnes-Hut against the direct sum, relative to the
+// largest force
+#define MAX_REL_ERROR 0.01
+#define G 6.67f
+#define EPSILON 50.0f
+
+using namespace std;
+
+/**
+ * \brief Spawners as the scene places them, on a plane at y = 1
+ */
+static NBodyBodies random_bodies(const GLuint n) {
+    mt19937 rng(n);
+    uniform_real_distribution<float> pos(-30, 30);
+    uniform_real_distribution<float> mass(49, 51);
+    NBodyBodies b;
+    for (GLuint i = 0; i < n; ++i) {
+        b.x.push_back(pos(rng));
+        b.y.push_back(1);
+        b.z.push_back(pos(rng));
+        b.mass.push_back(mass(rng));
+    }
+    return b;
+}
+
+/**
+ * \return max error of acc against the exact sum in double, over the
+ * largest exact force
+ */
+static double relative_error(const NBodyBodies &b, const vector<vec3> &acc) {
+    const GLuint n = b.x.size();
+    double err = 0, largest = 0;
+    for (GLuint i = 0; i < n; ++i) {
+        double exact[3] = {};
+        for (GLuint j = 0; j < n; ++j) {
+            const double d[3] = {b.x[j] - b.x[i], b.y[j] - b.y[i],
+                                 b.z[j] - b.z[i]};
+            const double d2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+            if (d2 <= 0)
+                continue;
+            const double s = G * b.mass[j] /
+                ((d2 + EPSILON*EPSILON) * sqrt(d2));
+            for (GLuint k = 0; k < 3; ++k)
+                exact[k] += d[k] * s;
+        }
+        double diff = 0, len = 0;
+        for (GLuint k = 0; k < 3; ++k) {
+            diff += (acc[i][k] - exact[k]) * (acc[i][k] - exact[k]);
+            len += exact[k] * exact[k];
+        }
+        err = std::max(err, sqrt(diff));
+        largest = std::max(largest, sqrt(len));
+    }
+    return largest > 0 ? err / largest : err;
+}
+
+int main() {
+    ThreadPool pool(4);
+    // Direct sum, just past the octree threshold and a large scene
+    for (const GLuint n: {3u, 600u, 10000u}) {
+        const NBodyBodies bodies = random_bodies(n);
+        NBodyWorkspace work;
+        vector<vec3> serial, threaded;
+        ComputeAccelerations(bodies, G, EPSILON, &work, &serial, nullptr);
+        ComputeAccelerations(bodies, G, EPSILON, &work, &threaded, &pool);
+
+        const double err = relative_error(bodies, serial);
+        if (err > MAX_REL_ERROR)
+            THROW(1, "{} bodies are off by {:.3f}% of the largest force",
+                  n, err * 100);
+        // Every body sums the same list on any thread
+        for (GLuint i = 0; i < n; ++i)
+            for (GLuint k = 0; k < 3; ++k)
+                if (serial[i][k] != threaded[i][k])
+                    THROW(1, "Body {} of {} differs between the serial and "
+                          "the threaded step", i, n);
+        INF("{} bodies: max error {:.3f}% of the largest force", n,
+            err * 100);
+    }
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "render_graph.hpp"
+#include "renderer.hpp"
+#include "logger.hpp"
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <string>
+#include <vector>
+
+// The GL entry points render_graph.cpp and profiler.cpp link against
+#define DEF(TYPE, NAME) TYPE NAME;
+#include "gl_func.hpp"
+
+using namespace std;
+
+// What the graph issued, in order
+static vector<string> ran;
+static vector<GLbitfield> barriers;
+static GLuint next_buffer = 1;
+
+// Test double, the graph only needs the barrier noted on the shared clock
+void Program::FinishComputes(const GLuint type) {
+    barriers.push_back(type);
+    RecordBarrier(type);
+}
+
+static void APIENTRY gen_buffers(const GLsizei n, GLuint *bufs) {
+    for (GLsizei i = 0; i < n; ++i)
+        bufs[i] = next_buffer++;
+}
+
+static void APIENTRY bind_buffer(const GLenum, const GLuint) {}
+
+static void APIENTRY buffer_data(const GLenum, const GLsizeiptr,
+                                 const void *, const GLenum) {}
+
+static void APIENTRY delete_buffers(const GLsizei, const GLuint *) {}
+
+static function<void()> record(const string &name) {
+    return [name]() { ran.push_back(name); };
+}
+
+/**
+ * \return zero if the passes ran in the expected order
+ */
+static int expect_order(const vector<string> &expected) {
+    if (ran != expected) {
+        string got;
+        for (const string &name: ran)
+            got += name + " ";
+        THROW(1, "Passes ran as {}", got);
+    }
+    ran.clear();
+    return 0;
+}
+
+/**
+ * \brief A pass that needs no barrier goes before one that waits for a
+ * shader write, and the barrier comes right before the reader
+ */
+static int test_barrier_free_first() {
+    RenderGraph graph;
+    const GLuint a = graph.Import("a", GRAPH_RESOURCE_BUFFER);
+    const GLuint b = graph.Import("b", GRAPH_RESOURCE_TEXTURE);
+    graph.AddPass("write", {GraphWrite(a, GRAPH_ACCESS_SSBO)},
+                  record("write"));
+    graph.AddPass("read", {GraphRead(a, GRAPH_ACCESS_SSBO)}, [&]() {
+        ran.push_back("read");
+        if (barriers != vector<GLbitfield>{GL_SHADER_STORAGE_BARRIER_BIT})
+            ran.push_back("no barrier");
+    });
+    graph.AddPass("free", {GraphRead(b, GRAPH_ACCESS_SAMPLE)},
+                  record("free"));
+    barriers.clear();
+    graph.Execute();
+    return expect_order({"write", "free", "read"});
+}
+
+/**
+ * \brief A barrier issued once covers later readers of its kind, also in
+ * the next Execute and from outside the graph, but not other kinds
+ */
+static int test_barrier_once() {
+    RenderGraph graph;
+    const GLuint a = graph.Import("a", GRAPH_RESOURCE_BUFFER);
+    const GLuint b = graph.Import("b", GRAPH_RESOURCE_BUFFER);
+    graph.AddPass("write", {
+        GraphWrite(a, GRAPH_ACCESS_SSBO),
+        GraphWrite(b, GRAPH_ACCESS_SSBO),
+    }, record("write"));
+    graph.AddPass("read", {GraphRead(a, GRAPH_ACCESS_SSBO)},
+                  record("read"));
+    barriers.clear();
+    graph.Execute();
+
+    Program::FinishComputes(GL_BUFFER_UPDATE_BARRIER_BIT);
+    graph.AddPass("again", {GraphRead(a, GRAPH_ACCESS_SSBO)},
+                  record("again"));
+    graph.AddPass("copy", {GraphRead(b, GRAPH_ACCESS_TRANSFER)},
+                  record("copy"));
+    graph.AddPass("indirect", {GraphRead(a, GRAPH_ACCESS_INDIRECT)},
+                  record("indirect"));
+    graph.Execute();
+    if (barriers != vector<GLbitfield>{GL_SHADER_STORAGE_BARRIER_BIT,
+                                       GL_BUFFER_UPDATE_BARRIER_BIT,
+                                       GL_COMMAND_BARRIER_BIT})
+        THROW(1, "Issued {} barriers instead of 3", barriers.size());
+    return expect_order({"write", "read", "again", "copy", "indirect"});
+}
+
+/**
+ * \brief Mirrors the reorder of ParticleSystem: the clear depends on
+ * nothing and runs early, the sort itself only after the simulation
+ */
+static int test_reorder_order() {
+    RenderGraph graph;
+    const GLuint particles = graph.Import("particles", GRAPH_RESOURCE_BUFFER);
+    const GLuint draw_cmd = graph.Import("draw_cmd", GRAPH_RESOURCE_BUFFER);
+    const GLuint buckets = graph.CreateBuffer("sort_buckets", 64);
+    graph.AddPass("emit", {GraphWrite(particles, GRAPH_ACCESS_SSBO)},
+                  record("emit"));
+    graph.AddPass("args", {GraphWrite(draw_cmd, GRAPH_ACCESS_SSBO)},
+                  record("args"));
+    graph.AddPass("sim", {
+        GraphRead(draw_cmd, GRAPH_ACCESS_INDIRECT),
+        GraphWrite(particles, GRAPH_ACCESS_SSBO),
+    }, record("sim"));
+    graph.AddPass("sort_clear", {GraphWrite(buckets, GRAPH_ACCESS_TRANSFER)},
+                  record("sort_clear"));
+    graph.AddPass("sort_keys", {
+        GraphRead(particles, GRAPH_ACCESS_SSBO),
+        GraphWrite(buckets, GRAPH_ACCESS_SSBO),
+    }, record("sort_keys"));
+    graph.AddPass("sort_scan", {GraphWrite(buckets, GRAPH_ACCESS_SSBO)},
+                  record("sort_scan"));
+    graph.Execute();
+    return expect_order({"emit", "args", "sort_clear", "sim", "sort_keys",
+                         "sort_scan"});
+}
+
+/**
+ * \brief Mirrors GenTextures: the mipmaps are made from image store writes,
+ * which needs the fetch barrier on top of the texture update one
+ */
+static int test_mipmap_barrier() {
+    RenderGraph graph;
+    const GLuint tex = graph.Import("tex", GRAPH_RESOURCE_TEXTURE);
+    graph.AddPass("texgen", {GraphWrite(tex, GRAPH_ACCESS_IMAGE)},
+                  record("texgen"));
+    graph.AddPass("mipmap", {
+        GraphRead(tex, GRAPH_ACCESS_SAMPLE),
+        GraphWrite(tex, GRAPH_ACCESS_TRANSFER),
+    }, record("mipmap"));
+    barriers.clear();
+    graph.Execute();
+    if (barriers != vector<GLbitfield>{GL_TEXTURE_FETCH_BARRIER_BIT |
+                                       GL_TEXTURE_UPDATE_BARRIER_BIT})
+        THROW(1, "Mipmap pass got the wrong barriers");
+    return expect_order({"texgen", "mipmap"});
+}
+
+/**
+ * \brief Imports keep their ids across Execute, transients get a handle
+ * from the pool inside their passes
+ */
+static int test_stable_ids() {
+    RenderGraph graph;
+    const GLuint a = graph.Import("a", GRAPH_RESOURCE_BUFFER);
+    const GLuint scratch = graph.CreateBuffer("scratch", 16);
+    if (!(scratch & GRAPH_TRANSIENT_BIT))
+        THROW(1, "Transient id {} looks like an import", scratch);
+    GLuint handle = 0;
+    graph.AddPass("fill", {GraphWrite(scratch, GRAPH_ACCESS_SSBO)}, [&]() {
+        handle = graph.GetHandle(scratch);
+    });
+    graph.Execute();
+    if (!handle)
+        THROW(1, "Transient had no handle in its pass");
+
+    const GLuint b = graph.Import("b", GRAPH_RESOURCE_BUFFER);
+    if (graph.Import("a", GRAPH_RESOURCE_BUFFER) != a || b == a)
+        THROW(1, "Import ids changed across Execute");
+    graph.AddPass("write", {GraphWrite(a, GRAPH_ACCESS_SSBO)},
+                  record("write"));
+    graph.AddPass("read", {GraphRead(a, GRAPH_ACCESS_SSBO)}, record("read"));
+    graph.Execute();
+    return expect_order({"write", "read"});
+}
+
+int main() {
+    glGenBuffers = gen_buffers;
+    glBindBuffer = bind_buffer;
+    glBufferData = buffer_data;
+    glDeleteBuffers = delete_buffers;
+
+    int ret = test_barrier_free_first();
+    ret |= test_barrier_once();
+    ret |= test_reorder_order();
+    ret |= test_mipmap_barrier();
+    ret |= test_stable_ids();
+    if (!ret)
+        INF("Render graph passes ran in order with the barriers they need");
+    return ret;
+}